@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "libmidi_batch.h"
+
+#define NUM_FILES 40
+#define MISSING_FILE "batchtest_missing.mid"
+
+//one track holding only a note and its end
+static const uint8_t song[] = {
+  'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 96,
+  'M', 'T', 'r', 'k', 0, 0, 0, 12,
+  0x00, 0x90, 60, 100,
+  0x60, 0x80, 60, 0,
+  0x00, 0xFF, 0x2F, 0
+};
+
+static char names[NUM_FILES + 1][32];
+
+typedef struct {
+  pthread_mutex_t lock;
+  int seen[NUM_FILES + 1];
+  int loaded;
+  int failed;
+} Counts;
+
+#ifdef __NR_io_uring_enter
+/* io_uring_enter fails with EINVAL once enter_calls reaches fail_from,
+ * fail_count times, to drive the loader's recovery path */
+static int enter_calls, fail_from, fail_count;
+
+long syscall(long number, ...)
+{
+  static long (*real)(long, ...);
+  va_list ap;
+  long a[6];
+  int i;
+
+  if (!real)
+    real = (long (*)(long, ...))dlsym(RTLD_NEXT, "syscall");
+
+  va_start(ap, number);
+  for (i = 0; i < 6; i++)
+    a[i] = va_arg(ap, long);
+  va_end(ap);
+
+  if (number == __NR_io_uring_enter && fail_from > 0
+      && ++enter_calls >= fail_from && fail_count > 0){
+    fail_count--;
+    errno = EINVAL;
+    return -1;
+  }
+  return real(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+#endif
+
+static void write_files(void)
+{
+  FILE * file;
+  size_t written;
+  int i;
+
+  for (i = 0; i < NUM_FILES; i++){
+    snprintf(names[i], sizeof(names[i]), "batchtest_%d.mid", i);
+    file = fopen(names[i], "wb");
+    assert(file);
+    written = fwrite(song, 1, sizeof(song), file);
+    assert(written == sizeof(song));
+    fclose(file);
+  }
+  snprintf(names[NUM_FILES], sizeof(names[NUM_FILES]), "%s", MISSING_FILE);
+}
+
+static void loaded(const char * filename, int error, const uint8_t * data,
+                   size_t size, void * user_data)
+{
+  Counts * counts = (Counts*)user_data;
+  MIDIMemFile midi;
+  MIDITrack track;
+  int i, r;
+
+  for (i = 0; i <= NUM_FILES && strcmp(names[i], filename) != 0; i++);
+  assert(i <= NUM_FILES);
+
+  if (error == SUCCESS){
+    assert(size == sizeof(song) && memcmp(data, song, size) == 0);
+    r = MIDIMemFile_open(&midi, data, size);
+    assert(r == SUCCESS);
+    r = MIDIMemFile_load_track(&midi, 0, &track);
+    assert(r == SUCCESS);
+    MIDITrack_delete_events(&track);
+    MIDIMemFile_close(&midi);
+  }
+
+  pthread_mutex_lock(&counts->lock);
+  counts->seen[i]++;
+  if (error == SUCCESS)
+    counts->loaded++;
+  else
+    counts->failed++;
+  pthread_mutex_unlock(&counts->lock);
+}
+
+//every file is handed to the callback exactly once
+static void load_all(const MIDIBatchOptions * options)
+{
+  const char * list[NUM_FILES + 1];
+  Counts counts;
+  int i, r;
+
+  memset(&counts, 0, sizeof(counts));
+  pthread_mutex_init(&counts.lock, NULL);
+  for (i = 0; i <= NUM_FILES; i++)
+    list[i] = names[i];
+
+  r = MIDIBatch_load(list, NUM_FILES + 1, options, loaded, &counts);
+  assert(r == SUCCESS);
+  for (i = 0; i <= NUM_FILES; i++)
+    assert(counts.seen[i] == 1);
+  assert(counts.loaded == NUM_FILES && counts.failed == 1);
+  pthread_mutex_destroy(&counts.lock);
+}
+
+int main(){
+  MIDIBatchOptions options;
+  int i;
+
+  write_files();
+  memset(&options, 0, sizeof(options));
+  options.queue_depth = 4;
+  options.num_threads = 3;
+
+  load_all(NULL);
+  load_all(&options);
+
+  options.force_threads = true;
+  load_all(&options);
+  options.force_threads = false;
+
+#ifdef __NR_io_uring_enter
+  //io_uring breaks with reads in flight, which are cancelled and retried
+  enter_calls = 0;
+  fail_from = 3;
+  fail_count = 1;
+  load_all(&options);
+
+  //the cancel fails as well, the reads are retried anyway
+  enter_calls = 0;
+  fail_count = 1000;
+  load_all(&options);
+  fail_from = 0;
+#endif
+
+  for (i = 0; i < NUM_FILES; i++)
+    remove(names[i]);
+  puts("batch: all tests passed");
+  return 0;
+}
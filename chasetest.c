@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <assert.h>
+#include "libmidi.h"
+
+//controller number and value of each event MIDIChaseState_emit produced
+static int emitted(MIDIChaseState * state, uint8_t out[][2], int max)
+{
+  MIDITrack track;
+  MIDIEventNode * node;
+  MIDIChannelEventData * data;
+  int n = 0, r;
+
+  track.list = MIDIEventList_create();
+  assert(track.list);
+  r = MIDIChaseState_emit(state, &track);
+  assert(r == SUCCESS);
+
+  for (node = track.list->head; node; node = node->next){
+    assert(node->ev.type == EV_CONTROLLER);
+    assert(n < max);
+    data = (MIDIChannelEventData*)node->ev.data;
+    out[n][0] = data->param1;
+    out[n][1] = data->param2;
+    n++;
+  }
+  MIDITrack_delete_events(&track);
+  return n;
+}
+
+static void controller(MIDIChaseState * state, uint8_t ctr, uint8_t value)
+{
+  int r;
+
+  r = MIDIChaseState_update(state, EV_CONTROLLER, 0, ctr, value);
+  assert(r == SUCCESS);
+}
+
+static void expect(MIDIChaseState * state, const uint8_t want[][2], int n)
+{
+  uint8_t got[256][2];
+  int i, count;
+
+  count = emitted(state, got, 256);
+  assert(count == n);
+  for (i = 0; i < n; i++){
+    assert(got[i][0] == want[i][0]);
+    assert(got[i][1] == want[i][1]);
+  }
+}
+
+static void test_rpn(void)
+{
+  MIDIChaseState state;
+  const uint8_t want[][2] = {
+    {101, 0}, {100, 0}, {6, 12}, {38, 0}, {101, 0}, {100, 1}, {6, 64}
+  };
+
+  MIDIChaseState_init(&state);
+  controller(&state, 101, 0);
+  controller(&state, 100, 0);
+  controller(&state, 6, 12);
+  controller(&state, 38, 0);
+  controller(&state, 100, 1);
+  controller(&state, 6, 64);
+  expect(&state, want, 7);
+  MIDIChaseState_delete(&state);
+}
+
+static void test_increment(void)
+{
+  MIDIChaseState state;
+  const uint8_t unknown[][2] = {
+    {101, 0}, {100, 2}, {96, 0}, {96, 0}
+  };
+  const uint8_t known[][2] = {
+    {101, 0}, {100, 2}, {6, 11}, {38, 127}
+  };
+
+  //nothing to step from, so the steps are replayed
+  MIDIChaseState_init(&state);
+  controller(&state, 101, 0);
+  controller(&state, 100, 2);
+  controller(&state, 96, 0);
+  controller(&state, 96, 0);
+  controller(&state, 96, 0);
+  controller(&state, 97, 0);
+  expect(&state, unknown, 4);
+
+  //once the value is known it is stepped directly
+  controller(&state, 6, 12);
+  controller(&state, 97, 0);
+  expect(&state, known, 4);
+  MIDIChaseState_delete(&state);
+}
+
+static void test_reset(void)
+{
+  MIDIChaseState state;
+  const uint8_t want[][2] = { {121, 0}, {7, 100} };
+  int r;
+
+  MIDIChaseState_init(&state);
+  controller(&state, 1, 10);
+  controller(&state, 7, 100);
+  controller(&state, 64, 127);
+  r = MIDIChaseState_update(&state, EV_PITCH_BEND, 0, 0, 0x50);
+  assert(r == SUCCESS);
+  controller(&state, 121, 0);
+  expect(&state, want, 2);
+  MIDIChaseState_delete(&state);
+}
+
+static void test_modes(void)
+{
+  MIDIChaseState state;
+  const uint8_t want[][2] = { {125, 0}, {127, 0} };
+
+  MIDIChaseState_init(&state);
+  controller(&state, 124, 0);
+  controller(&state, 126, 1);
+  controller(&state, 125, 0);
+  controller(&state, 127, 0);
+  //notes off and sound off are not chased
+  controller(&state, 123, 0);
+  controller(&state, 120, 0);
+  expect(&state, want, 2);
+  MIDIChaseState_delete(&state);
+}
+
+static void test_many_params(void)
+{
+  MIDIChaseState state;
+  uint8_t got[256][2];
+  int i, n, entries = 0;
+
+  MIDIChaseState_init(&state);
+  for (i = 0; i < 40; i++){
+    controller(&state, 99, 1);
+    controller(&state, 98, i);
+    controller(&state, 6, i + 1);
+  }
+
+  //every parameter survives, the last one selected comes last
+  n = emitted(&state, got, 256);
+  for (i = 0; i < n; i++){
+    if (got[i][0] == 6){
+      assert(got[i - 1][0] == 98);
+      assert(got[i][1] == got[i - 1][1] + 1);
+      entries++;
+    }
+  }
+  assert(entries == 40);
+  assert(got[n - 1][0] == 6 && got[n - 1][1] == 40);
+  MIDIChaseState_delete(&state);
+}
+
+static void test_tracks(void)
+{
+  MIDIChaseState state;
+  MIDITrack tracks[2];
+  uint32_t applied[2];
+  const uint8_t want[][2] = { {7, 50} };
+  int i, r;
+
+  for (i = 0; i < 2; i++){
+    tracks[i].list = MIDIEventList_create();
+    assert(tracks[i].list);
+  }
+  //the track that comes first in the file sets the later value
+  r = MIDITrack_add_channel_event(&tracks[0], EV_CONTROLLER, 0, 100, 7, 50);
+  assert(r == SUCCESS);
+  r = MIDITrack_add_channel_event(&tracks[1], EV_CONTROLLER, 0, 10, 7, 100);
+  assert(r == SUCCESS);
+  r = MIDITrack_add_channel_event(&tracks[1], EV_CONTROLLER, 0, 290, 7, 0);
+  assert(r == SUCCESS);
+
+  MIDIChaseState_init(&state);
+  r = MIDIChaseState_chase_tracks(&state, tracks, 2, 200, applied);
+  assert(r == SUCCESS);
+  assert(applied[0] == 1 && applied[1] == 1);
+  expect(&state, want, 1);
+  MIDIChaseState_delete(&state);
+
+  for (i = 0; i < 2; i++)
+    MIDITrack_delete_events(&tracks[i]);
+}
+
+int main(){
+  test_rpn();
+  test_increment();
+  test_reset();
+  test_modes();
+  test_many_params();
+  test_tracks();
+  puts("chase: all tests passed");
+  return 0;
+}
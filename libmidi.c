@@ -2,11 +2,135 @@
  * Copyright (c) 2014 Nicholas Parkanyi
  * See LICENSE
 */
+#define _XOPEN_SOURCE 500
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "libmidi.h"
 
+/* decoding context for a single load call
+ * reads from a stdio stream (advancing its position), from a descriptor
+ * at an explicit offset, or from a buffer in memory, so concurrent loads
+ * never share a cursor */
+typedef struct {
+  FILE * file;
+  int fd;
+  //set when reading from memory, size bytes long
+  const uint8_t * data;
+  size_t size;
+  int64_t offset;
+  //text meta events are only kept when this is set
+  MIDIStringPool * strings;
+} MIDIReader;
+
+static MIDIReader MIDIReader_from_file(FILE * file)
+{
+  MIDIReader reader = { file, -1, NULL, 0, 0, NULL };
+
+  return reader;
+}
+
+static MIDIReader MIDIReader_from_fd(int fd, int64_t offset)
+{
+  MIDIReader reader = { NULL, fd, NULL, 0, offset, NULL };
+
+  return reader;
+}
+
+static MIDIReader MIDIReader_from_buffer(const uint8_t * data, size_t size,
+                                         int64_t offset)
+{
+  MIDIReader reader = { NULL, -1, data, size, offset, NULL };
+
+  return reader;
+}
+
+//read exactly n bytes, returns false on short read or error
+static bool MIDIReader_read(MIDIReader * reader, void * buf, size_t n)
+{
+  unsigned char * dst = (unsigned char*)buf;
+  ssize_t r;
+
+  if (reader->file)
+    return fread(buf, 1, n, reader->file) == n;
+
+  if (reader->data){
+    if (reader->offset < 0 || (size_t)reader->offset > reader->size
+        || reader->size - (size_t)reader->offset < n)
+      return false;
+    memcpy(buf, reader->data + reader->offset, n);
+    reader->offset += n;
+    return true;
+  }
+
+  while (n > 0){
+    r = pread(reader->fd, dst, n, (off_t)reader->offset);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    dst += r;
+    n -= r;
+    reader->offset += r;
+  }
+  return true;
+}
+
+//bytes left to read, -1 if unknown (e.g. a pipe)
+static int64_t MIDIReader_remaining(const MIDIReader * reader)
+{
+  struct stat st;
+  int64_t pos;
+
+  if (reader->data)
+    return reader->offset < (int64_t)reader->size
+           ? (int64_t)reader->size - reader->offset : 0;
+
+  if (reader->file){
+    pos = ftell(reader->file);
+    if (pos < 0 || fstat(fileno(reader->file), &st) != 0
+        || !S_ISREG(st.st_mode))
+      return -1;
+  } else {
+    pos = reader->offset;
+    if (fstat(reader->fd, &st) != 0 || !S_ISREG(st.st_mode))
+      return -1;
+  }
+  return st.st_size > pos ? (int64_t)st.st_size - pos : 0;
+}
+
+static bool MIDIReader_skip(MIDIReader * reader, uint32_t n)
+{
+  if (reader->file)
+    return fseek(reader->file, n, SEEK_CUR) == 0;
+
+  reader->offset += n;
+  return true;
+}
+
+/* where decoded events go, exactly one of these is set */
+typedef struct {
+  MIDITrack * track;
+  MIDIPackedTrack * packed;
+} MIDIEventSink;
+
+static int MIDIEventSink_add_channel_event(MIDIEventSink * sink,
+                                           uint8_t type, uint8_t channel,
+                                           uint32_t delta, uint8_t param1,
+                                           uint8_t param2);
+static int MIDIEventSink_add_meta_event(MIDIEventSink * sink, uint32_t delta,
+                                        MetaType type, void * data);
+
+static int MIDIHeader_read(MIDIHeader * header, MIDIReader * reader);
+static int MIDITrack_read(MIDITrack * track, MIDIReader * reader);
+static int MIDIPackedTrack_read(MIDIPackedTrack * track, MIDIReader * reader);
+static int MIDITrack_read_events(MIDIEventSink * sink, MIDIReader * reader);
+
 //convert big-endian data to little endian in-place, does nothing on BE host
 void be_to_le(void* vdata, int bytes)
 {
@@ -23,16 +147,16 @@ void be_to_le(void* vdata, int bytes)
 #endif
 }
 
-int VLV_read(FILE * buf, uint32_t * val, int * bytes_read)
+static int VLV_read_reader(MIDIReader * reader, uint32_t * val,
+                           int * bytes_read)
 {
   uint8_t byte;
-  uint8_t a;
   int i;
 
   *val = 0x00;
 
   for (i = 0; i < 4; i++){
-    if (fread(&byte, 1, 1, buf) != 1)
+    if (!MIDIReader_read(reader, &byte, 1))
       return FILE_IO_ERROR;
 
     *val = ((*val << 7) | (byte % 128));
@@ -47,6 +171,13 @@ int VLV_read(FILE * buf, uint32_t * val, int * bytes_read)
   return VLV_ERROR;
 }
 
+int VLV_read(FILE * buf, uint32_t * val, int * bytes_read)
+{
+  MIDIReader reader = MIDIReader_from_file(buf);
+
+  return VLV_read_reader(&reader, val, bytes_read);
+}
+
 
 int MIDIFile_load(MIDIFile * midi, const char * filename)
 {
@@ -56,6 +187,7 @@ int MIDIFile_load(MIDIFile * midi, const char * filename)
   if (!midi->file)
     return FILE_IO_ERROR;
 
+  midi->strings = NULL;
   r = MIDIHeader_load(&midi->header, midi->file);
   if (r != SUCCESS)
     fclose(midi->file);
@@ -63,26 +195,229 @@ int MIDIFile_load(MIDIFile * midi, const char * filename)
   return r;
 }
 
+int MIDIFile_load_track(MIDIFile * midi, MIDITrack * track)
+{
+  MIDIReader reader = MIDIReader_from_file(midi->file);
+
+  reader.strings = midi->strings;
+  return MIDITrack_read(track, &reader);
+}
+
+int MIDIFile_load_packed_track(MIDIFile * midi, MIDIPackedTrack * track)
+{
+  MIDIReader reader = MIDIReader_from_file(midi->file);
+
+  reader.strings = midi->strings;
+  return MIDIPackedTrack_read(track, &reader);
+}
+
 void MIDIFile_delete(MIDIFile * midi)
 {
     fclose(midi->file);
 }
 
-int MIDIHeader_load(MIDIHeader * header, FILE * file)
+/* reads the header at the start of reader and records the offset of every
+ * track chunk, so tracks can be loaded in any order */
+static int MIDIReader_index_tracks(MIDIReader reader, MIDIHeader * header,
+                                   int64_t ** track_offsets)
 {
-  int i;
-  char const * name = "MThd";
+  MIDITrackHeader chunk;
+  char const * name = "MTrk";
+  int64_t offset;
+  int r, i;
+  uint16_t found = 0;
+
+  r = MIDIHeader_read(header, &reader);
+  if (r != SUCCESS)
+    return r;
+
+  *track_offsets =
+    (int64_t*)malloc(sizeof(int64_t) * (header->num_tracks + 1));
+  if (!*track_offsets)
+    return MEMORY_ERROR;
+
+  offset = 8 + (int64_t)header->size;
+  while (found < header->num_tracks){
+    reader.offset = offset;
+    if (!MIDIReader_read(&reader, &chunk, sizeof(MIDITrackHeader))){
+      free(*track_offsets);
+      *track_offsets = NULL;
+      return FILE_INVALID;
+    }
+    be_to_le(&chunk.size, sizeof(uint32_t));
+
+    //unknown chunk types are skipped, as the spec requires
+    for (i = 0; i < 4 && chunk.id[i] == name[i]; i++);
+    if (i == 4)
+      (*track_offsets)[found++] = offset;
+
+    offset += sizeof(MIDITrackHeader) + (int64_t)chunk.size;
+  }
 
-  if (fread(&header->id, sizeof(uint8_t), 4, file) < 1)
+  return SUCCESS;
+}
+
+int MIDIFileHandle_open(MIDIFileHandle * midi, const char * filename)
+{
+  int r;
+
+  midi->fd = open(filename, O_RDONLY);
+  if (midi->fd < 0)
+    return FILE_IO_ERROR;
+  midi->strings = NULL;
+
+  r = MIDIReader_index_tracks(MIDIReader_from_fd(midi->fd, 0),
+                              &midi->header, &midi->track_offsets);
+  if (r != SUCCESS)
+    close(midi->fd);
+
+  return r;
+}
+
+/* reads the whole track chunk (header included) into a new buffer with
+ * one pread, so it can be decoded from memory instead of with a syscall
+ * per byte. the buffer stops at the end of the file, a truncated chunk is
+ * left for the decoder to reject */
+static int MIDIFileHandle_read_chunk(const MIDIFileHandle * midi,
+                                     uint16_t index, uint8_t ** data,
+                                     size_t * size)
+{
+  MIDIReader reader = MIDIReader_from_fd(midi->fd,
+                                         midi->track_offsets[index]);
+  MIDITrackHeader chunk;
+  int64_t available;
+
+  available = MIDIReader_remaining(&reader);
+  if (!MIDIReader_read(&reader, &chunk, sizeof(MIDITrackHeader)))
+    return FILE_IO_ERROR;
+  be_to_le(&chunk.size, sizeof(uint32_t));
+
+  *size = sizeof(MIDITrackHeader) + (size_t)chunk.size;
+  if (available >= 0 && (uint64_t)available < *size)
+    *size = (size_t)available;
+
+  *data = (uint8_t*)malloc(*size);
+  if (!*data)
+    return MEMORY_ERROR;
+
+  reader.offset = midi->track_offsets[index];
+  if (!MIDIReader_read(&reader, *data, *size)){
+    free(*data);
+    return FILE_IO_ERROR;
+  }
+  return SUCCESS;
+}
+
+int MIDIFileHandle_load_track(const MIDIFileHandle * midi, uint16_t index,
+                              MIDITrack * track)
+{
+  MIDIReader reader;
+  uint8_t * data;
+  size_t size;
+  int r;
+
+  if (index >= midi->header.num_tracks)
     return FILE_INVALID;
-  if (fread(&header->size, sizeof(uint32_t), 1, file) < 1)
+
+  r = MIDIFileHandle_read_chunk(midi, index, &data, &size);
+  if (r != SUCCESS)
+    return r;
+
+  reader = MIDIReader_from_buffer(data, size, 0);
+  reader.strings = midi->strings;
+  r = MIDITrack_read(track, &reader);
+  free(data);
+  return r;
+}
+
+int MIDIFileHandle_load_packed_track(const MIDIFileHandle * midi,
+                                     uint16_t index,
+                                     MIDIPackedTrack * track)
+{
+  MIDIReader reader;
+  uint8_t * data;
+  size_t size;
+  int r;
+
+  if (index >= midi->header.num_tracks)
     return FILE_INVALID;
-  if (fread(&header->format, sizeof(uint16_t), 1, file) < 1)
+
+  r = MIDIFileHandle_read_chunk(midi, index, &data, &size);
+  if (r != SUCCESS)
+    return r;
+
+  reader = MIDIReader_from_buffer(data, size, 0);
+  reader.strings = midi->strings;
+  r = MIDIPackedTrack_read(track, &reader);
+  free(data);
+  return r;
+}
+
+void MIDIFileHandle_close(MIDIFileHandle * midi)
+{
+  free(midi->track_offsets);
+  midi->track_offsets = NULL;
+  close(midi->fd);
+}
+
+int MIDIMemFile_open(MIDIMemFile * midi, const uint8_t * data, size_t size)
+{
+  midi->data = data;
+  midi->size = size;
+  midi->strings = NULL;
+
+  return MIDIReader_index_tracks(MIDIReader_from_buffer(data, size, 0),
+                                 &midi->header, &midi->track_offsets);
+}
+
+int MIDIMemFile_load_track(const MIDIMemFile * midi, uint16_t index,
+                           MIDITrack * track)
+{
+  MIDIReader reader;
+
+  if (index >= midi->header.num_tracks)
     return FILE_INVALID;
-  if (fread(&header->num_tracks, sizeof(uint16_t), 1, file) < 1)
+
+  reader = MIDIReader_from_buffer(midi->data, midi->size,
+                                  midi->track_offsets[index]);
+  reader.strings = midi->strings;
+  return MIDITrack_read(track, &reader);
+}
+
+int MIDIMemFile_load_packed_track(const MIDIMemFile * midi, uint16_t index,
+                                  MIDIPackedTrack * track)
+{
+  MIDIReader reader;
+
+  if (index >= midi->header.num_tracks)
     return FILE_INVALID;
-  if (fread(&header->time_div, sizeof(uint16_t), 1, file) < 1)
+
+  reader = MIDIReader_from_buffer(midi->data, midi->size,
+                                  midi->track_offsets[index]);
+  reader.strings = midi->strings;
+  return MIDIPackedTrack_read(track, &reader);
+}
+
+void MIDIMemFile_close(MIDIMemFile * midi)
+{
+  free(midi->track_offsets);
+  midi->track_offsets = NULL;
+}
+
+static int MIDIHeader_read(MIDIHeader * header, MIDIReader * reader)
+{
+  int i;
+  char const * name = "MThd";
+  //id, size, format, num_tracks, time_div, read in one go
+  uint8_t raw[14];
+
+  if (!MIDIReader_read(reader, raw, sizeof(raw)))
     return FILE_INVALID;
+  memcpy(&header->id, raw, 4);
+  memcpy(&header->size, raw + 4, sizeof(uint32_t));
+  memcpy(&header->format, raw + 8, sizeof(uint16_t));
+  memcpy(&header->num_tracks, raw + 10, sizeof(uint16_t));
+  memcpy(&header->time_div, raw + 12, sizeof(uint16_t));
 
   //swap endianness (does nothing if host is BE)
   be_to_le(&header->size, sizeof(uint32_t));
@@ -99,6 +434,13 @@ int MIDIHeader_load(MIDIHeader * header, FILE * file)
   return SUCCESS;
 }
 
+int MIDIHeader_load(MIDIHeader * header, FILE * file)
+{
+  MIDIReader reader = MIDIReader_from_file(file);
+
+  return MIDIHeader_read(header, &reader);
+}
+
 
 uint32_t MIDIHeader_getTempoConversion(MIDIHeader * header, uint32_t tempo)
 {
@@ -196,6 +538,27 @@ int MIDIEventList_append(MIDIEventList * list, MIDIEvent ev)
 }
 
 
+/* a string id is stored in the data pointer shifted left with the low bit
+ * set. malloc never returns an odd address, so a tagged id can't be
+ * mistaken for caller data, and id 0 isn't NULL */
+static void * text_id_to_data(uint32_t id)
+{
+  return (void*)(((uintptr_t)id << 1) | 1);
+}
+
+bool MIDIEvent_is_text(const MIDIEvent * ev)
+{
+  return ev->type >= (EventType)META_TEXT
+      && ev->type <= (EventType)META_CUE_POINT
+      && ((uintptr_t)ev->data & 1);
+}
+
+uint32_t MIDIEvent_get_string_id(const MIDIEvent * ev)
+{
+  return (uint32_t)((uintptr_t)ev->data >> 1);
+}
+
+
 void MIDIEventList_delete(MIDIEventList * list)
 {
   MIDIEventNode * tmp;
@@ -204,7 +567,9 @@ void MIDIEventList_delete(MIDIEventList * list)
 
   while (list->head){
     tmp = list->head->next;
-    free(list->head->ev.data);
+    //text ids live in the pointer itself
+    if (!MIDIEvent_is_text(&list->head->ev))
+      free(list->head->ev.data);
     free(list->head);
     list->head = tmp;
   }
@@ -212,32 +577,50 @@ void MIDIEventList_delete(MIDIEventList * list)
 }
 
 
-int MIDITrack_load(MIDITrack * track, FILE * file)
+static int MIDITrackHeader_read(MIDITrackHeader * header,
+                                MIDIReader * reader)
 {
   int i;
   char const * name = "MTrk";
 
-  if (fread(&track->header.id, sizeof(uint8_t), 4, file) < 4)
+  if (!MIDIReader_read(reader, &header->id, 4))
 	return FILE_IO_ERROR;
-  if (fread(&track->header.size, sizeof(uint32_t), 1, file) < 1)
+  if (!MIDIReader_read(reader, &header->size, sizeof(uint32_t)))
     return FILE_IO_ERROR;
 
   //swap endianness
-  be_to_le(&track->header.size, sizeof(uint32_t));
+  be_to_le(&header->size, sizeof(uint32_t));
 
   //if id is not "MTrk", not a track
   for (i = 0; i < 4; i++){
-    if (track->header.id[i] != name[i]){
+    if (header->id[i] != name[i]){
       return FILE_INVALID;
     }
   }
+  return SUCCESS;
+}
+
+static int MIDITrack_read(MIDITrack * track, MIDIReader * reader)
+{
+  MIDIEventSink sink = { track, NULL };
+  int r;
+
+  r = MIDITrackHeader_read(&track->header, reader);
+  if (r != SUCCESS)
+    return r;
 
   track->list = MIDIEventList_create();
   if (!track->list)
     return MEMORY_ERROR;
 
-  //MIDITrack_load_events(track, file);
-  return MIDITrack_load_events(track, file);
+  return MIDITrack_read_events(&sink, reader);
+}
+
+int MIDITrack_load(MIDITrack * track, FILE * file)
+{
+  MIDIReader reader = MIDIReader_from_file(file);
+
+  return MIDITrack_read(track, &reader);
 }
 
 
@@ -266,6 +649,36 @@ int MIDITrack_skip(FILE * file)
 }
 
 
+/* reads the text of a meta event into the reader's string pool, the event
+ * keeps only the interned id, stored in its data pointer */
+static int MIDITrack_read_text_event(MIDIEventSink * sink, MIDIReader * reader,
+                                     uint32_t delta, MetaType type,
+                                     uint32_t size)
+{
+  char local[256];
+  char * text = local;
+  uint32_t id;
+  int r;
+
+  if (size > sizeof(local)){
+    text = (char*)malloc(size);
+    if (!text) return MEMORY_ERROR;
+  }
+
+  if (!MIDIReader_read(reader, text, size)){
+    if (text != local) free(text);
+    return FILE_IO_ERROR;
+  }
+
+  r = MIDIStringPool_intern(reader->strings, text, size, &id);
+  if (text != local) free(text);
+  if (r != SUCCESS)
+    return r;
+
+  return MIDIEventSink_add_meta_event(sink, delta, type,
+                                      text_id_to_data(id));
+}
+
 float hour_byte_to_fps(uint8_t byte)
 {
   uint8_t rate = byte >> 5; //remove all but the rate bits
@@ -284,7 +697,7 @@ float hour_byte_to_fps(uint8_t byte)
   }
 }
 
-int MIDITrack_load_events(MIDITrack * track, FILE * file)
+static int MIDITrack_read_events(MIDIEventSink * sink, MIDIReader * reader)
 {
   int bytes_read = 0;
   int vlv_read;
@@ -295,27 +708,26 @@ int MIDITrack_load_events(MIDITrack * track, FILE * file)
   uint8_t ev_type;
   uint8_t ev_channel;
   uint8_t param1, param2;
-  const int size = track->header.size;
   uint32_t meta_size;
   int r;
 
   do {
-    if (VLV_read(file, &ev_delta_time, &vlv_read) == VLV_ERROR)
+    if (VLV_read_reader(reader, &ev_delta_time, &vlv_read) == VLV_ERROR)
       return FILE_IO_ERROR;
-    if (fread(&ev_type_channel, sizeof(uint8_t), 1, file) < 1)
+    if (!MIDIReader_read(reader, &ev_type_channel, 1))
       return FILE_IO_ERROR;
     //meta events
     if (ev_type_channel == 0xFF){
-      if (fread(&ev_type, sizeof(uint8_t), 1, file) < 1)
+      if (!MIDIReader_read(reader, &ev_type, 1))
         return FILE_IO_ERROR;
 
-      if (VLV_read(file, &meta_size, &vlv_read) == VLV_ERROR)
+      if (VLV_read_reader(reader, &meta_size, &vlv_read) == VLV_ERROR)
         return FILE_IO_ERROR;
 
       if (ev_type == META_END_TRACK){
         if (meta_size != 0)
           return FILE_INVALID;
-        r = MIDITrack_add_meta_event(track, ev_delta_time, META_END_TRACK, NULL);
+        r = MIDIEventSink_add_meta_event(sink, ev_delta_time, META_END_TRACK, NULL);
       } else if (ev_type == META_TEMPO_CHANGE){
         if (meta_size != 3)
           return FILE_INVALID;
@@ -324,12 +736,12 @@ int MIDITrack_load_events(MIDITrack * track, FILE * file)
         tempo = (uint32_t*)malloc(sizeof(uint32_t));
         if (!tempo) return MEMORY_ERROR;
         *(char*)(tempo) = 0;
-        if (fread((char*)(tempo) + 1, sizeof(uint8_t), 3, file) < 1){
+        if (!MIDIReader_read(reader, (char*)(tempo) + 1, 3)){
           free(tempo);
           return FILE_IO_ERROR;
         }
         be_to_le(tempo, sizeof(uint32_t));
-        r = MIDITrack_add_meta_event(track, ev_delta_time, META_TEMPO_CHANGE, tempo);
+        r = MIDIEventSink_add_meta_event(sink, ev_delta_time, META_TEMPO_CHANGE, tempo);
       } else if (ev_type == META_SMPTE_OFFSET){
         if (meta_size != 5)
           return FILE_INVALID;
@@ -338,7 +750,7 @@ int MIDITrack_load_events(MIDITrack * track, FILE * file)
         smpte = (SMPTEData*)malloc(sizeof(SMPTEData));
         if (!smpte) return MEMORY_ERROR;
 
-        if (fread(&(smpte->hours), sizeof(uint8_t), 1, file) < 1)
+        if (!MIDIReader_read(reader, &(smpte->hours), 1))
           return FILE_INVALID;
 
         smpte->framerate = hour_byte_to_fps(smpte->hours);
@@ -347,38 +759,44 @@ int MIDITrack_load_events(MIDITrack * track, FILE * file)
           return FILE_INVALID;
         }
 
-        if (fread(&(smpte->minutes), sizeof(uint8_t), 1, file) < 1){
+        if (!MIDIReader_read(reader, &(smpte->minutes), 1)){
           free(smpte);
           return FILE_INVALID;
         }
 
-        if (fread(&(smpte->seconds), sizeof(uint8_t), 1, file) < 1){
+        if (!MIDIReader_read(reader, &(smpte->seconds), 1)){
           free(smpte);
           return FILE_INVALID;
         }
 
-        if (fread(&(smpte->frames), sizeof(uint8_t), 1, file) < 1){
+        if (!MIDIReader_read(reader, &(smpte->frames), 1)){
           free(smpte);
           return FILE_INVALID;
         }
 
-        if (fread(&(smpte->subframes), sizeof(uint8_t), 1, file) < 1){
+        if (!MIDIReader_read(reader, &(smpte->subframes), 1)){
           free(smpte);
           return FILE_INVALID;
         }
 
-        r = MIDITrack_add_meta_event(track, ev_delta_time, META_SMPTE_OFFSET, smpte);
+        r = MIDIEventSink_add_meta_event(sink, ev_delta_time, META_SMPTE_OFFSET, smpte);
+      } else if (reader->strings && ev_type >= META_TEXT
+                 && ev_type <= META_CUE_POINT){
+        r = MIDITrack_read_text_event(sink, reader, ev_delta_time,
+                                      (MetaType)ev_type, meta_size);
+        if (r != SUCCESS)
+          return r;
       } else {
         //for ignored events, skip their data bytes
-        if (fseek(file, meta_size, SEEK_CUR) != 0)
+        if (!MIDIReader_skip(reader, meta_size))
           return FILE_INVALID;
       }
       continue;
     //sysex events, ignore all these
     } else if (ev_type_channel == 0xF0 || ev_type_channel == 0xF7){
-      if (VLV_read(file, &meta_size, &vlv_read) == VLV_ERROR)
+      if (VLV_read_reader(reader, &meta_size, &vlv_read) == VLV_ERROR)
         return FILE_IO_ERROR;
-      if (fseek(file, meta_size, SEEK_CUR) != 0)
+      if (!MIDIReader_skip(reader, meta_size))
         return FILE_INVALID;
       continue;
     }
@@ -389,7 +807,7 @@ int MIDITrack_load_events(MIDITrack * track, FILE * file)
     if ((ev_type_channel & 0x80) != 0){
       ev_type = (ev_type_channel & 0xF0) >> 4;
       ev_channel = ev_type_channel & 0x0F;
-      if (fread(&param1, sizeof(uint8_t), 1, file) < 1)
+      if (!MIDIReader_read(reader, &param1, 1))
         return FILE_IO_ERROR;
     } else {
       param1 = ev_type_channel;
@@ -398,13 +816,13 @@ int MIDITrack_load_events(MIDITrack * track, FILE * file)
     //channel events that only have 1 parameter
     if (ev_type == EV_PROGRAM_CHANGE ||
         ev_type == EV_CHANNEL_AFTERTOUCH){
-      r = MIDITrack_add_channel_event(track, ev_type, ev_channel,
-                                      ev_delta_time, param1, 0);
+      r = MIDIEventSink_add_channel_event(sink, ev_type, ev_channel,
+                                          ev_delta_time, param1, 0);
     } else {
-      if (fread(&param2, sizeof(uint8_t), 1, file) < 1)
+      if (!MIDIReader_read(reader, &param2, 1))
         return FILE_IO_ERROR;
 
-      r = MIDITrack_add_channel_event(track, ev_type, ev_channel,
+      r = MIDIEventSink_add_channel_event(sink, ev_type, ev_channel,
           ev_delta_time, param1,
           param2);
     }
@@ -414,6 +832,14 @@ int MIDITrack_load_events(MIDITrack * track, FILE * file)
   return SUCCESS;
 }
 
+int MIDITrack_load_events(MIDITrack * track, FILE * file)
+{
+  MIDIReader reader = MIDIReader_from_file(file);
+  MIDIEventSink sink = { track, NULL };
+
+  return MIDITrack_read_events(&sink, &reader);
+}
+
 
 int MIDITrack_add_channel_event(MIDITrack * track,
                                  uint8_t type, uint8_t channel,
@@ -451,12 +877,252 @@ int MIDITrack_add_meta_event(MIDITrack * track, uint32_t delta, MetaType type,
   return MIDIEventList_append(track->list, temp);
 }
 
+int MIDITrack_add_text_event(MIDITrack * track, uint32_t delta,
+                             MetaType type, uint32_t id)
+{
+  if (type < META_TEXT || type > META_CUE_POINT)
+    return FILE_INVALID;
+
+  return MIDITrack_add_meta_event(track, delta, type, text_id_to_data(id));
+}
+
 
 void MIDITrack_delete_events(MIDITrack * track)
 {
   MIDIEventList_delete(track->list);
 }
 
+//size of the block ev->data points to, as allocated by the loader
+static size_t MIDIEvent_data_size(const MIDIEvent * ev)
+{
+  if (!ev->data || MIDIEvent_is_text(ev))
+    return 0;
+
+  if (ev->type >= EV_NOTE_OFF && ev->type <= EV_PITCH_BEND)
+    return sizeof(MIDIChannelEventData);
+
+  switch ((int)ev->type){
+    case META_TEMPO_CHANGE:
+      return sizeof(uint32_t);
+    case META_SMPTE_OFFSET:
+      return sizeof(SMPTEData);
+    //the loader keeps no other data, its size is unknown
+    default:
+      return 0;
+  }
+}
+
+size_t MIDITrack_memory_usage(const MIDITrack * track)
+{
+  MIDIEventNode * node;
+  size_t total;
+
+  if (!track->list)
+    return 0;
+
+  total = sizeof(MIDIEventList);
+  for (node = track->list->head; node; node = node->next)
+    total += sizeof(MIDIEventNode) + MIDIEvent_data_size(&node->ev);
+
+  return total;
+}
+
+
+//appends an uninitialized event, returns NULL if out of memory
+static MIDIPackedEvent * MIDIPackedTrack_push(MIDIPackedTrack * track)
+{
+  MIDIPackedEvent * events;
+  uint32_t capacity;
+
+  if (track->num_events == track->capacity){
+    capacity = track->capacity ? track->capacity * 2 : 64;
+    events = (MIDIPackedEvent*)realloc(track->events,
+                                       sizeof(MIDIPackedEvent) * capacity);
+    if (!events)
+      return NULL;
+    track->events = events;
+    track->capacity = capacity;
+  }
+  return &track->events[track->num_events++];
+}
+
+static int MIDIEventSink_add_channel_event(MIDIEventSink * sink,
+                                           uint8_t type, uint8_t channel,
+                                           uint32_t delta, uint8_t param1,
+                                           uint8_t param2)
+{
+  MIDIPackedEvent * ev;
+
+  if (!sink->packed)
+    return MIDITrack_add_channel_event(sink->track, type, channel, delta,
+                                       param1, param2);
+
+  ev = MIDIPackedTrack_push(sink->packed);
+  if (!ev)
+    return MEMORY_ERROR;
+
+  ev->delta_time = delta;
+  ev->status = (uint8_t)((type << 4) | (channel & 0x0F));
+  ev->data[0] = param1;
+  ev->data[1] = param2;
+  ev->data[2] = 0;
+  return SUCCESS;
+}
+
+static int MIDIEventSink_add_meta_event(MIDIEventSink * sink, uint32_t delta,
+                                        MetaType type, void * data)
+{
+  MIDIPackedTrack * track = sink->packed;
+  MIDIPackedEvent * ev;
+  MIDIEvent * meta;
+  uint32_t capacity;
+
+  if (!track)
+    return MIDITrack_add_meta_event(sink->track, delta, type, data);
+
+  //the index has to fit in the 3 data bytes of the escape event
+  if (track->num_metas > 0xFFFFFF)
+    return MEMORY_ERROR;
+
+  if (track->num_metas == track->meta_capacity){
+    capacity = track->meta_capacity ? track->meta_capacity * 2 : 8;
+    meta = (MIDIEvent*)realloc(track->metas, sizeof(MIDIEvent) * capacity);
+    if (!meta)
+      return MEMORY_ERROR;
+    track->metas = meta;
+    track->meta_capacity = capacity;
+  }
+
+  ev = MIDIPackedTrack_push(track);
+  if (!ev)
+    return MEMORY_ERROR;
+
+  ev->delta_time = delta;
+  ev->status = 0xFF;
+  ev->data[0] = track->num_metas & 0xFF;
+  ev->data[1] = (track->num_metas >> 8) & 0xFF;
+  ev->data[2] = (track->num_metas >> 16) & 0xFF;
+
+  meta = &track->metas[track->num_metas++];
+  meta->type = (EventType)type;
+  meta->delta_time = delta;
+  meta->data = data;
+  return SUCCESS;
+}
+
+
+//bytes assumed for a track when the input size can't be known
+#define PACKED_UNKNOWN_SIZE_GUESS 8192
+
+static int MIDIPackedTrack_read(MIDIPackedTrack * track, MIDIReader * reader)
+{
+  MIDIEventSink sink = { NULL, track };
+  MIDIPackedEvent * events;
+  MIDIEvent * metas;
+  int64_t available;
+  int r;
+
+  track->events = NULL;
+  track->num_events = 0;
+  track->capacity = 0;
+  track->metas = NULL;
+  track->num_metas = 0;
+  track->meta_capacity = 0;
+
+  r = MIDITrackHeader_read(&track->header, reader);
+  if (r != SUCCESS)
+    return r;
+
+  /* an event takes at least 2 bytes in the file, so this is usually the
+   * only allocation needed. the size comes from the file, so it is capped
+   * by what can actually be read */
+  available = MIDIReader_remaining(reader);
+  if (available < 0)
+    available = PACKED_UNKNOWN_SIZE_GUESS;
+  if (available > track->header.size)
+    available = track->header.size;
+  track->capacity = (uint32_t)(available / 2) + 1;
+  track->events =
+    (MIDIPackedEvent*)malloc(sizeof(MIDIPackedEvent) * track->capacity);
+  if (!track->events){
+    track->capacity = 0;
+    return MEMORY_ERROR;
+  }
+
+  r = MIDITrack_read_events(&sink, reader);
+  if (r != SUCCESS)
+    return r;
+
+  //give back the unused tails, the track is read-only from here
+  //(a loaded track always has at least its end of track event)
+  if (track->num_events < track->capacity){
+    events = (MIDIPackedEvent*)realloc(track->events,
+                                       sizeof(MIDIPackedEvent)
+                                       * track->num_events);
+    if (events){
+      track->events = events;
+      track->capacity = track->num_events;
+    }
+  }
+  if (track->num_metas < track->meta_capacity){
+    metas = (MIDIEvent*)realloc(track->metas,
+                                sizeof(MIDIEvent) * track->num_metas);
+    if (metas){
+      track->metas = metas;
+      track->meta_capacity = track->num_metas;
+    }
+  }
+  return SUCCESS;
+}
+
+int MIDIPackedTrack_load(MIDIPackedTrack * track, FILE * file)
+{
+  MIDIReader reader = MIDIReader_from_file(file);
+
+  return MIDIPackedTrack_read(track, &reader);
+}
+
+MIDIEvent * MIDIPackedTrack_get_meta(const MIDIPackedTrack * track,
+                                     const MIDIPackedEvent * ev)
+{
+  uint32_t index;
+
+  if (ev->status != 0xFF)
+    return NULL;
+
+  index = ev->data[0] | (ev->data[1] << 8) | ((uint32_t)ev->data[2] << 16);
+  return &track->metas[index];
+}
+
+void MIDIPackedTrack_delete_events(MIDIPackedTrack * track)
+{
+  uint32_t i;
+
+  for (i = 0; i < track->num_metas; i++){
+    if (!MIDIEvent_is_text(&track->metas[i]))
+      free(track->metas[i].data);
+  }
+  free(track->metas);
+  free(track->events);
+  track->metas = NULL;
+  track->events = NULL;
+  track->num_metas = track->meta_capacity = 0;
+  track->num_events = track->capacity = 0;
+}
+
+size_t MIDIPackedTrack_memory_usage(const MIDIPackedTrack * track)
+{
+  size_t total;
+  uint32_t i;
+
+  total = sizeof(MIDIPackedEvent) * track->capacity
+        + sizeof(MIDIEvent) * track->meta_capacity;
+  for (i = 0; i < track->num_metas; i++)
+    total += MIDIEvent_data_size(&track->metas[i]);
+
+  return total;
+}
+
 unsigned long SMPTE_to_milliseconds(SMPTEData smpte)
 {
   return 3600000 * smpte.hours
@@ -465,3 +1131,688 @@ unsigned long SMPTE_to_milliseconds(SMPTEData smpte)
         + (1000.0f / smpte.framerate) * smpte.frames
         + (10.0f / smpte.framerate) * smpte.subframes;
 }
+
+
+struct _MIDIStringBlock {
+  struct _MIDIStringBlock * next;
+  size_t used;
+  size_t size;
+  char data[];
+};
+
+#define STRING_BLOCK_SIZE 65536
+
+//FNV-1a
+static uint32_t string_hash(const char * str, uint32_t len)
+{
+  uint32_t hash = 2166136261u;
+  uint32_t i;
+
+  for (i = 0; i < len; i++){
+    hash ^= (uint8_t)str[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+MIDIStringPool * MIDIStringPool_create()
+{
+  MIDIStringPool * pool = (MIDIStringPool*)calloc(1, sizeof(MIDIStringPool));
+
+  if (!pool)
+    return NULL;
+
+  if (pthread_mutex_init(&pool->lock, NULL) != 0){
+    free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+void MIDIStringPool_delete(MIDIStringPool * pool)
+{
+  struct _MIDIStringBlock * tmp;
+
+  if (!pool) return;
+
+  while (pool->blocks){
+    tmp = pool->blocks->next;
+    free(pool->blocks);
+    pool->blocks = tmp;
+  }
+  free(pool->strings);
+  free(pool->lengths);
+  free(pool->table);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+//doubles the hash table, slots hold id + 1 so 0 marks an empty slot
+static int MIDIStringPool_grow_table(MIDIStringPool * pool)
+{
+  uint32_t size = pool->table_size ? pool->table_size * 2 : 256;
+  uint32_t * table = (uint32_t*)calloc(size, sizeof(uint32_t));
+  uint32_t id, slot;
+
+  if (!table)
+    return MEMORY_ERROR;
+
+  for (id = 0; id < pool->count; id++){
+    slot = string_hash(pool->strings[id], pool->lengths[id]) & (size - 1);
+    while (table[slot])
+      slot = (slot + 1) & (size - 1);
+    table[slot] = id + 1;
+  }
+
+  free(pool->table);
+  pool->table = table;
+  pool->table_size = size;
+  return SUCCESS;
+}
+
+//copies str into the arena, returns NULL if out of memory
+static const char * MIDIStringPool_store(MIDIStringPool * pool,
+                                         const char * str, uint32_t len)
+{
+  struct _MIDIStringBlock * block = pool->blocks;
+  size_t size;
+  char * dst;
+
+  if (!block || block->size - block->used < (size_t)len + 1){
+    size = (size_t)len + 1 > STRING_BLOCK_SIZE ? (size_t)len + 1
+                                                : STRING_BLOCK_SIZE;
+    block = (struct _MIDIStringBlock*)malloc(sizeof(*block) + size);
+    if (!block)
+      return NULL;
+    block->used = 0;
+    block->size = size;
+    block->next = pool->blocks;
+    pool->blocks = block;
+  }
+
+  dst = block->data + block->used;
+  memcpy(dst, str, len);
+  dst[len] = '\0';
+  block->used += (size_t)len + 1;
+  return dst;
+}
+
+static int MIDIStringPool_intern_locked(MIDIStringPool * pool,
+                                        const char * str, uint32_t len,
+                                        uint32_t * id)
+{
+  uint32_t hash = string_hash(str, len);
+  uint32_t slot, cand, capacity;
+  const char * stored;
+
+  //keep the table at most half full
+  if ((pool->count + 1) * 2 > pool->table_size){
+    if (MIDIStringPool_grow_table(pool) != SUCCESS)
+      return MEMORY_ERROR;
+  }
+
+  slot = hash & (pool->table_size - 1);
+  while ((cand = pool->table[slot]) != 0){
+    cand--;
+    if (pool->lengths[cand] == len
+        && memcmp(pool->strings[cand], str, len) == 0){
+      *id = cand;
+      return SUCCESS;
+    }
+    slot = (slot + 1) & (pool->table_size - 1);
+  }
+
+  if (pool->count == pool->capacity){
+    capacity = pool->capacity ? pool->capacity * 2 : 64;
+    const char ** strings =
+      (const char**)realloc(pool->strings, sizeof(char*) * capacity);
+    if (!strings) return MEMORY_ERROR;
+    pool->strings = strings;
+    uint32_t * lengths =
+      (uint32_t*)realloc(pool->lengths, sizeof(uint32_t) * capacity);
+    if (!lengths) return MEMORY_ERROR;
+    pool->lengths = lengths;
+    pool->capacity = capacity;
+  }
+
+  stored = MIDIStringPool_store(pool, str, len);
+  if (!stored)
+    return MEMORY_ERROR;
+
+  *id = pool->count++;
+  pool->strings[*id] = stored;
+  pool->lengths[*id] = len;
+  pool->table[slot] = *id + 1;
+  return SUCCESS;
+}
+
+int MIDIStringPool_intern(MIDIStringPool * pool, const char * str,
+                          uint32_t len, uint32_t * id)
+{
+  int r;
+
+  pthread_mutex_lock(&pool->lock);
+  r = MIDIStringPool_intern_locked(pool, str, len, id);
+  pthread_mutex_unlock(&pool->lock);
+  return r;
+}
+
+const char * MIDIStringPool_get(MIDIStringPool * pool, uint32_t id,
+                                uint32_t * len)
+{
+  const char * str = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  if (id < pool->count){
+    str = pool->strings[id];
+    if (len != NULL)
+      *len = pool->lengths[id];
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return str;
+}
+
+uint32_t MIDIStringPool_count(MIDIStringPool * pool)
+{
+  uint32_t count;
+
+  pthread_mutex_lock(&pool->lock);
+  count = pool->count;
+  pthread_mutex_unlock(&pool->lock);
+  return count;
+}
+
+
+//MIDIChannelState flags
+#define CHASE_PROGRAM 0x01
+#define CHASE_PITCH_BEND 0x02
+#define CHASE_PRESSURE 0x04
+//a reset all controllers message was seen
+#define CHASE_RESET 0x08
+
+#define CTR_DATA_ENTRY_LSB (CTR_DATA_ENTRY + 0x20)
+#define CTR_RESET_ALL 0x79
+#define NULL_PARAM 0x7F
+
+static void MIDIChannelState_set_controller(MIDIChannelState * ch,
+                                            uint8_t ctr, uint8_t value)
+{
+  ch->controllers[ctr] = value;
+  ch->controllers_set[ctr >> 5] |= 1u << (ctr & 31);
+}
+
+static void MIDIChannelState_clear_controller(MIDIChannelState * ch,
+                                              uint8_t ctr)
+{
+  ch->controllers_set[ctr >> 5] &= ~(1u << (ctr & 31));
+}
+
+static bool MIDIChannelState_has_controller(const MIDIChannelState * ch,
+                                            uint8_t ctr)
+{
+  return (ch->controllers_set[ctr >> 5] >> (ctr & 31)) & 1;
+}
+
+//whether data entry applies to any parameter at the moment
+static bool MIDIChannelState_has_selected(const MIDIChannelState * ch)
+{
+  return ch->select_type != 0
+         && !(ch->select_msb == NULL_PARAM && ch->select_lsb == NULL_PARAM);
+}
+
+/* the parameter data entry currently applies to, added to the table if
+ * it is new. NULL if the table could not grow */
+static MIDIParamState * MIDIChannelState_selected(MIDIChannelState * ch)
+{
+  uint16_t number = (ch->select_msb << 7) | ch->select_lsb;
+  uint8_t nrpn = ch->select_type == 2;
+  MIDIParamState * param;
+  uint32_t i, capacity;
+
+  for (i = 0; i < ch->num_params; i++){
+    if (ch->params[i].number == number && ch->params[i].nrpn == nrpn)
+      return &ch->params[i];
+  }
+
+  if (ch->num_params == ch->params_capacity){
+    capacity = ch->params_capacity ? ch->params_capacity * 2 : 4;
+    param = (MIDIParamState*)realloc(ch->params,
+                                     capacity * sizeof(MIDIParamState));
+    if (!param)
+      return NULL;
+    ch->params = param;
+    ch->params_capacity = capacity;
+  }
+  param = &ch->params[ch->num_params++];
+  param->number = number;
+  param->nrpn = nrpn;
+  param->value = 0;
+  param->steps = 0;
+  param->set = 0;
+  return param;
+}
+
+//whether the parameter has anything for a chase to send
+static bool MIDIParamState_chased(const MIDIParamState * param)
+{
+  return param->set || param->steps;
+}
+
+static int MIDIChannelState_controller(MIDIChannelState * ch, uint8_t ctr,
+                                       uint8_t value)
+{
+  MIDIParamState * param;
+
+  switch (ctr){
+    case CTR_NON_REG_PARAM_MSB:
+    case CTR_REG_PARAM_MSB:
+      ch->select_type = ctr == CTR_REG_PARAM_MSB ? 1 : 2;
+      ch->select_msb = value;
+      return SUCCESS;
+    case CTR_NON_REG_PARAM_LSB:
+    case CTR_REG_PARAM_LSB:
+      ch->select_type = ctr == CTR_REG_PARAM_LSB ? 1 : 2;
+      ch->select_lsb = value;
+      return SUCCESS;
+    case CTR_DATA_ENTRY:
+    case CTR_DATA_ENTRY_LSB:
+    case CTR_DATA_INCR:
+    case CTR_DATA_DECR:
+      if (!MIDIChannelState_has_selected(ch))
+        return SUCCESS;
+      param = MIDIChannelState_selected(ch);
+      if (!param)
+        return MEMORY_ERROR;
+      //an absolute value replaces whatever earlier steps did
+      if (ctr == CTR_DATA_ENTRY){
+        param->value = (value << 7) | (param->value & 0x7F);
+        param->set |= 1;
+        param->steps = 0;
+      } else if (ctr == CTR_DATA_ENTRY_LSB){
+        param->value = (param->value & 0x3F80) | value;
+        param->set |= 2;
+        param->steps = 0;
+      } else if (!(param->set & 1)){
+        if (ctr == CTR_DATA_INCR && param->steps < INT16_MAX)
+          param->steps++;
+        else if (ctr == CTR_DATA_DECR && param->steps > INT16_MIN)
+          param->steps--;
+      } else if (ctr == CTR_DATA_INCR && param->value < 0x3FFF){
+        param->value++;
+        param->set |= 3;
+      } else if (ctr == CTR_DATA_DECR && param->value > 0){
+        param->value--;
+        param->set |= 3;
+      }
+      return SUCCESS;
+    //all sound off and all notes off leave nothing to chase
+    case 0x78:
+    case 0x7B:
+      return SUCCESS;
+    //reset all controllers, following RP-015: bank, volume, pan, sound
+    // and effect controllers and parameter values are kept
+    case CTR_RESET_ALL:
+      MIDIChannelState_clear_controller(ch, CTR_MODULATION);
+      MIDIChannelState_clear_controller(ch, CTR_EXPRESSION);
+      MIDIChannelState_clear_controller(ch, CTR_DAMPER);
+      MIDIChannelState_clear_controller(ch, CTR_PORTAMENTO);
+      MIDIChannelState_clear_controller(ch, CTR_SOSTENUTO);
+      MIDIChannelState_clear_controller(ch, CTR_SOFT);
+      ch->select_type = 0;
+      ch->flags &= ~(CHASE_PITCH_BEND | CHASE_PRESSURE);
+      ch->flags |= CHASE_RESET;
+      return SUCCESS;
+    //omni off/on and mono/poly exclude each other
+    case 0x7C:
+    case 0x7D:
+    case 0x7E:
+    case 0x7F:
+      MIDIChannelState_clear_controller(ch, ctr ^ 1);
+      break;
+  }
+  MIDIChannelState_set_controller(ch, ctr, value);
+  return SUCCESS;
+}
+
+void MIDIChaseState_init(MIDIChaseState * state)
+{
+  memset(state, 0, sizeof(MIDIChaseState));
+}
+
+void MIDIChaseState_delete(MIDIChaseState * state)
+{
+  int i;
+
+  for (i = 0; i < 16; i++){
+    free(state->channels[i].params);
+    state->channels[i].params = NULL;
+    state->channels[i].num_params = 0;
+    state->channels[i].params_capacity = 0;
+  }
+}
+
+int MIDIChaseState_update(MIDIChaseState * state, uint8_t type,
+                          uint8_t channel, uint8_t param1, uint8_t param2)
+{
+  MIDIChannelState * ch = &state->channels[channel & 0x0F];
+
+  switch (type){
+    case EV_CONTROLLER:
+      return MIDIChannelState_controller(ch, param1 & 0x7F, param2 & 0x7F);
+    case EV_PROGRAM_CHANGE:
+      ch->program = param1 & 0x7F;
+      ch->flags |= CHASE_PROGRAM;
+      break;
+    case EV_CHANNEL_AFTERTOUCH:
+      ch->pressure = param1 & 0x7F;
+      ch->flags |= CHASE_PRESSURE;
+      break;
+    case EV_PITCH_BEND:
+      ch->pitch_bend = ((param2 & 0x7F) << 7) | (param1 & 0x7F);
+      ch->flags |= CHASE_PITCH_BEND;
+      break;
+    //notes and polyphonic aftertouch leave no channel state
+    default:
+      break;
+  }
+  return SUCCESS;
+}
+
+int MIDIChaseState_update_event(MIDIChaseState * state, const MIDIEvent * ev)
+{
+  const MIDIChannelEventData * data;
+
+  if (ev->type < EV_NOTE_OFF || ev->type > EV_PITCH_BEND || !ev->data)
+    return SUCCESS;
+
+  data = (const MIDIChannelEventData*)ev->data;
+  return MIDIChaseState_update(state, ev->type, data->channel, data->param1,
+                               data->param2);
+}
+
+int MIDIChaseState_update_packed(MIDIChaseState * state,
+                                 const MIDIPackedEvent * events,
+                                 uint32_t count)
+{
+  uint32_t i;
+  int r;
+
+  for (i = 0; i < count; i++){
+    if (events[i].status == 0xFF)
+      continue;
+    r = MIDIChaseState_update(state, events[i].status >> 4,
+                              events[i].status & 0x0F, events[i].data[0],
+                              events[i].data[1]);
+    if (r != SUCCESS)
+      return r;
+  }
+  return SUCCESS;
+}
+
+int MIDIChaseState_chase_track(MIDIChaseState * state,
+                               const MIDITrack * track, uint32_t tick,
+                               uint32_t * applied)
+{
+  MIDIEventNode * node;
+  uint64_t time = 0;
+  int r;
+
+  *applied = 0;
+  if (!track->list)
+    return SUCCESS;
+
+  for (node = track->list->head; node; node = node->next){
+    time += node->ev.delta_time;
+    if (time >= tick)
+      break;
+    r = MIDIChaseState_update_event(state, &node->ev);
+    if (r != SUCCESS)
+      return r;
+    (*applied)++;
+  }
+  return SUCCESS;
+}
+
+int MIDIChaseState_chase_packed_track(MIDIChaseState * state,
+                                      const MIDIPackedTrack * track,
+                                      uint32_t tick, uint32_t * applied)
+{
+  uint64_t time = 0;
+  uint32_t count;
+
+  //find the range first, then apply it in one pass
+  for (count = 0; count < track->num_events; count++){
+    time += track->events[count].delta_time;
+    if (time >= tick)
+      break;
+  }
+  *applied = count;
+  return MIDIChaseState_update_packed(state, track->events, count);
+}
+
+//next event to apply from one track of a multi-track chase
+typedef struct {
+  const MIDIEventNode * node;    //list tracks
+  const MIDIPackedEvent * event; //packed tracks
+  uint32_t remaining;            //packed events left, counting event
+  uint64_t time;                 //absolute time of the next event
+  uint32_t applied;
+} MIDIChaseCursor;
+
+static bool MIDIChaseCursor_has_event(const MIDIChaseCursor * c,
+                                      uint32_t tick)
+{
+  return (c->node || c->remaining > 0) && c->time < tick;
+}
+
+/* merges the tracks by always applying the earliest next event. on equal
+ * ticks the lowest track is applied first, so a higher track's value wins.
+ * tracks are few, so a linear scan for the earliest is cheaper than
+ * keeping a heap */
+static int chase_merge(MIDIChaseState * state, MIDIChaseCursor * cursors,
+                       uint16_t num_tracks, uint32_t tick,
+                       uint32_t * applied)
+{
+  MIDIChaseCursor * c, * next;
+  uint16_t i;
+  int r = SUCCESS;
+
+  for (;;){
+    next = NULL;
+    for (i = 0; i < num_tracks; i++){
+      c = &cursors[i];
+      if (MIDIChaseCursor_has_event(c, tick)
+          && (!next || c->time < next->time))
+        next = c;
+    }
+    if (!next)
+      break;
+
+    if (next->node){
+      r = MIDIChaseState_update_event(state, &next->node->ev);
+      next->node = next->node->next;
+      if (next->node)
+        next->time += next->node->ev.delta_time;
+    } else {
+      r = MIDIChaseState_update_packed(state, next->event, 1);
+      next->event++;
+      if (--next->remaining > 0)
+        next->time += next->event->delta_time;
+    }
+    if (r != SUCCESS)
+      break;
+    next->applied++;
+  }
+
+  if (applied){
+    for (i = 0; i < num_tracks; i++)
+      applied[i] = cursors[i].applied;
+  }
+  return r;
+}
+
+int MIDIChaseState_chase_tracks(MIDIChaseState * state,
+                                const MIDITrack * tracks,
+                                uint16_t num_tracks, uint32_t tick,
+                                uint32_t * applied)
+{
+  MIDIChaseCursor * cursors;
+  uint16_t i;
+  int r;
+
+  cursors = (MIDIChaseCursor*)calloc(num_tracks ? num_tracks : 1,
+                                     sizeof(MIDIChaseCursor));
+  if (!cursors)
+    return MEMORY_ERROR;
+
+  for (i = 0; i < num_tracks; i++){
+    if (tracks[i].list && tracks[i].list->head){
+      cursors[i].node = tracks[i].list->head;
+      cursors[i].time = cursors[i].node->ev.delta_time;
+    }
+  }
+
+  r = chase_merge(state, cursors, num_tracks, tick, applied);
+  free(cursors);
+  return r;
+}
+
+int MIDIChaseState_chase_packed_tracks(MIDIChaseState * state,
+                                       const MIDIPackedTrack * tracks,
+                                       uint16_t num_tracks, uint32_t tick,
+                                       uint32_t * applied)
+{
+  MIDIChaseCursor * cursors;
+  uint16_t i;
+  int r;
+
+  cursors = (MIDIChaseCursor*)calloc(num_tracks ? num_tracks : 1,
+                                     sizeof(MIDIChaseCursor));
+  if (!cursors)
+    return MEMORY_ERROR;
+
+  for (i = 0; i < num_tracks; i++){
+    cursors[i].event = tracks[i].events;
+    cursors[i].remaining = tracks[i].num_events;
+    if (cursors[i].remaining > 0)
+      cursors[i].time = cursors[i].event->delta_time;
+  }
+
+  r = chase_merge(state, cursors, num_tracks, tick, applied);
+  free(cursors);
+  return r;
+}
+
+static int chase_controller(MIDITrack * out, uint8_t channel, uint8_t ctr,
+                            uint8_t value)
+{
+  return MIDITrack_add_channel_event(out, EV_CONTROLLER, channel, 0, ctr,
+                                     value);
+}
+
+static int chase_select(MIDITrack * out, uint8_t channel, bool nrpn,
+                        uint8_t msb, uint8_t lsb)
+{
+  int r;
+
+  r = chase_controller(out, channel,
+                       nrpn ? CTR_NON_REG_PARAM_MSB : CTR_REG_PARAM_MSB, msb);
+  if (r != SUCCESS)
+    return r;
+  return chase_controller(out, channel,
+                          nrpn ? CTR_NON_REG_PARAM_LSB : CTR_REG_PARAM_LSB,
+                          lsb);
+}
+
+static int MIDIChannelState_emit(const MIDIChannelState * ch,
+                                 uint8_t channel, MIDITrack * out)
+{
+  const MIDIParamState * param, * selected;
+  int r = SUCCESS;
+  uint32_t i;
+  int16_t steps;
+  uint8_t ctr;
+
+  if (ch->flags & CHASE_RESET)
+    r = chase_controller(out, channel, CTR_RESET_ALL, 0);
+
+  //bank select has to arrive before the program change
+  for (i = 0; i < 2 && r == SUCCESS; i++){
+    ctr = i == 0 ? CTR_BANK_SELECT : CTR_BANK_SELECT + 0x20;
+    if (MIDIChannelState_has_controller(ch, ctr))
+      r = chase_controller(out, channel, ctr, ch->controllers[ctr]);
+  }
+  if (r == SUCCESS && (ch->flags & CHASE_PROGRAM))
+    r = MIDITrack_add_channel_event(out, EV_PROGRAM_CHANGE, channel, 0,
+                                    ch->program, 0);
+
+  //14-bit controllers, MSB then LSB since an MSB may clear the LSB
+  for (ctr = 1; ctr < 0x20 && r == SUCCESS; ctr++){
+    if (MIDIChannelState_has_controller(ch, ctr))
+      r = chase_controller(out, channel, ctr, ch->controllers[ctr]);
+    if (r == SUCCESS && MIDIChannelState_has_controller(ch, ctr + 0x20))
+      r = chase_controller(out, channel, ctr + 0x20,
+                           ch->controllers[ctr + 0x20]);
+  }
+  for (ctr = 0x40; ctr < 0x80 && r == SUCCESS; ctr++){
+    if (MIDIChannelState_has_controller(ch, ctr))
+      r = chase_controller(out, channel, ctr, ch->controllers[ctr]);
+  }
+
+  /* the selected parameter goes last, so that its selection is still in
+   * effect afterwards, as it was in the song */
+  selected = NULL;
+  for (i = 0; i < ch->num_params; i++){
+    param = &ch->params[i];
+    if (ch->select_type != 0 && param->nrpn == (ch->select_type == 2)
+        && param->number == ((ch->select_msb << 7) | ch->select_lsb))
+      selected = param;
+  }
+  for (i = 0; i <= ch->num_params && r == SUCCESS; i++){
+    param = i < ch->num_params ? &ch->params[i] : selected;
+    if (!param || !MIDIParamState_chased(param)
+        || (param == selected && i < ch->num_params))
+      continue;
+    r = chase_select(out, channel, param->nrpn, param->number >> 7,
+                     param->number & 0x7F);
+    if (r == SUCCESS && (param->set & 1))
+      r = chase_controller(out, channel, CTR_DATA_ENTRY, param->value >> 7);
+    if (r == SUCCESS && (param->set & 2))
+      r = chase_controller(out, channel, CTR_DATA_ENTRY_LSB,
+                           param->value & 0x7F);
+    for (steps = param->steps; steps != 0 && r == SUCCESS;
+         steps += steps > 0 ? -1 : 1)
+      r = chase_controller(out, channel,
+                           steps > 0 ? CTR_DATA_INCR : CTR_DATA_DECR, 0);
+  }
+  //otherwise leave the same parameter selected as the song did, or none
+  if (r == SUCCESS && (!selected || !MIDIParamState_chased(selected))){
+    if (ch->select_type != 0)
+      r = chase_select(out, channel, ch->select_type == 2, ch->select_msb,
+                       ch->select_lsb);
+    else if (ch->num_params > 0)
+      r = chase_select(out, channel, false, NULL_PARAM, NULL_PARAM);
+  }
+
+  if (r == SUCCESS && (ch->flags & CHASE_PITCH_BEND))
+    r = MIDITrack_add_channel_event(out, EV_PITCH_BEND, channel, 0,
+                                    ch->pitch_bend & 0x7F,
+                                    ch->pitch_bend >> 7);
+  if (r == SUCCESS && (ch->flags & CHASE_PRESSURE))
+    r = MIDITrack_add_channel_event(out, EV_CHANNEL_AFTERTOUCH, channel, 0,
+                                    ch->pressure, 0);
+  return r;
+}
+
+int MIDIChaseState_emit(const MIDIChaseState * state, MIDITrack * out)
+{
+  int r;
+  uint8_t channel;
+
+  for (channel = 0; channel < 16; channel++){
+    r = MIDIChannelState_emit(&state->channels[channel], channel, out);
+    if (r != SUCCESS)
+      return r;
+  }
+  return SUCCESS;
+}
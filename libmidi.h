@@ -12,6 +12,7 @@ extern "C" {
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
 
 typedef enum {
   SUCCESS,
@@ -56,7 +57,7 @@ typedef enum {
   CTR_BANK_SELECT,
   CTR_MODULATION,
   CTR_BREATH,
-  CTR_FOOT,
+  CTR_FOOT = 0x04,
   CTR_PORTAMENTO_TIME,
   CTR_DATA_ENTRY,
   CTR_VOLUME,
@@ -149,16 +150,119 @@ typedef struct {
   uint32_t size;
 } MIDITrackHeader;
 
+//value of one registered or non-registered parameter
+typedef struct {
+  uint16_t number; //14 bits, MSB << 7 | LSB
+  uint16_t value;  //14 bits, data entry MSB << 7 | LSB
+  //data increments minus decrements sent while the MSB was not known,
+  // they are replayed as such since the value they applied to is not known
+  int16_t steps;
+  uint8_t nrpn;    //0 for an RPN, 1 for an NRPN
+  uint8_t set;     //bit 0: data entry MSB was sent, bit 1: LSB was sent
+} MIDIParamState;
+
+/* everything earlier events left behind on one channel: controllers,
+ * program, pitch bend, channel pressure and RPN/NRPN values.
+ * only values that events actually set are reproduced by a chase */
+typedef struct {
+  uint8_t controllers[128];
+  uint32_t controllers_set[4]; //one bit per controller in controllers
+  MIDIParamState * params;     //every RPN and NRPN the channel has used
+  uint32_t num_params;
+  uint32_t params_capacity;
+  uint16_t pitch_bend;         //14 bits, 0x2000 is centred
+  uint8_t program;
+  uint8_t pressure;
+  uint8_t flags;               //which of the fields above are set
+  //parameter selected for data entry by CC 98-101
+  uint8_t select_msb;
+  uint8_t select_lsb;
+  uint8_t select_type;         //0 none, 1 RPN, 2 NRPN
+} MIDIChannelState;
+
+/* state of all 16 channels, for starting playback anywhere but tick 0:
+ * feed it every channel event before the start tick, then play the
+ * events from MIDIChaseState_emit before the rest of the song.
+ * free with MIDIChaseState_delete */
+typedef struct {
+  MIDIChannelState channels[16];
+} MIDIChaseState;
+
 typedef struct {
   MIDITrackHeader header;
   MIDIEventList * list;
 } MIDITrack;
 
+/* compact form of a MIDIEvent, 8 bytes with no separate allocation.
+ * channel events: status is the status byte (type << 4 | channel),
+ * data[0] and data[1] are param1 and param2.
+ * all other events: status is 0xFF and data is a 24-bit little-endian
+ * index into the metas table of the owning MIDIPackedTrack. */
+typedef struct {
+  uint32_t delta_time;
+  uint8_t status;
+  uint8_t data[3];
+} MIDIPackedEvent;
+
+/* a track stored as one array of MIDIPackedEvent instead of a list */
+typedef struct {
+  MIDITrackHeader header;
+  MIDIPackedEvent * events;
+  uint32_t num_events;
+  uint32_t capacity;
+  //non-channel events, their data is the same as in a MIDITrack
+  MIDIEvent * metas;
+  uint32_t num_metas;
+  uint32_t meta_capacity;
+} MIDIPackedTrack;
+
+/* stores each distinct text (track names, lyrics, markers, ...) once and
+ * hands out small integer ids for it, so equal strings compare as equal ids.
+ * one pool can be shared by any number of files and threads. */
+typedef struct {
+  pthread_mutex_t lock;
+  struct _MIDIStringBlock * blocks;
+  const char ** strings; //indexed by id
+  uint32_t * lengths;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t * table;
+  uint32_t table_size;
+} MIDIStringPool;
+
 typedef struct {
   FILE * file;
   MIDIHeader header;
+  /* if not NULL, text meta events (META_TEXT to META_CUE_POINT) loaded
+   * with MIDIFile_load_track are kept, their data pointer holds an encoded id
+   * into this pool (see MIDIEvent_get_string_id) rather than pointing to
+   * memory. NULL after MIDIFile_load. */
+  MIDIStringPool * strings;
 } MIDIFile;
 
+/* reentrant alternative to MIDIFile
+ * reads with pread() at offsets recorded when the file is opened, so it
+ * holds no cursor: any number of threads may load tracks from one handle
+ * concurrently without locking */
+typedef struct {
+  int fd;
+  MIDIHeader header;
+  //offset of each "MTrk" chunk, header.num_tracks entries
+  int64_t * track_offsets;
+  //same as MIDIFile.strings
+  MIDIStringPool * strings;
+} MIDIFileHandle;
+
+/* same as MIDIFileHandle, but decodes a whole file already in memory.
+ * the data is not copied and must outlive the MIDIMemFile */
+typedef struct {
+  const uint8_t * data;
+  size_t size;
+  MIDIHeader header;
+  int64_t * track_offsets;
+  MIDIStringPool * strings;
+} MIDIMemFile;
+
 /* read Variable Length Value used by some MIDI values into val
  * never larger than 4 bytes
  * returns VLV_ERROR if fails
@@ -167,6 +271,27 @@ int VLV_read(FILE * buf, uint32_t * val, int * bytes_read);
 
 int MIDIFile_load(MIDIFile * midi, const char * filename);
 void MIDIFile_delete(MIDIFile * midi);
+/* like MIDITrack_load, but also keeps text events if midi->strings is set */
+int MIDIFile_load_track(MIDIFile * midi, MIDITrack * track);
+int MIDIFile_load_packed_track(MIDIFile * midi, MIDIPackedTrack * track);
+
+int MIDIFileHandle_open(MIDIFileHandle * midi, const char * filename);
+/* loads track number index (counting from 0), independent of any other
+ * load on the same handle; safe to call from several threads at once */
+int MIDIFileHandle_load_track(const MIDIFileHandle * midi, uint16_t index,
+                              MIDITrack * track);
+int MIDIFileHandle_load_packed_track(const MIDIFileHandle * midi,
+                                     uint16_t index,
+                                     MIDIPackedTrack * track);
+void MIDIFileHandle_close(MIDIFileHandle * midi);
+
+int MIDIMemFile_open(MIDIMemFile * midi, const uint8_t * data, size_t size);
+int MIDIMemFile_load_track(const MIDIMemFile * midi, uint16_t index,
+                           MIDITrack * track);
+int MIDIMemFile_load_packed_track(const MIDIMemFile * midi, uint16_t index,
+                                  MIDIPackedTrack * track);
+//does not free the data
+void MIDIMemFile_close(MIDIMemFile * midi);
 
 int MIDIHeader_load(MIDIHeader * header, FILE * file);
 //returns a factor that converts delta times to microseconds,
@@ -174,6 +299,13 @@ int MIDIHeader_load(MIDIHeader * header, FILE * file);
 // You must get a new conversion factor after any tempo change event.
 uint32_t MIDIHeader_getTempoConversion(MIDIHeader * header, uint32_t tempo);
 
+/* true for META_TEXT to META_CUE_POINT events holding a string id instead
+ * of a data pointer: those loaded into a MIDIStringPool and those added
+ * with MIDITrack_add_text_event. text events added with
+ * MIDITrack_add_meta_event keep their data, which is freed as usual */
+bool MIDIEvent_is_text(const MIDIEvent * ev);
+uint32_t MIDIEvent_get_string_id(const MIDIEvent * ev);
+
 MIDIEventList * MIDIEventList_create();
 MIDIEventIterator MIDIEventList_get_start_iter(MIDIEventList * list);
 MIDIEventIterator MIDIEventList_get_end_iter(MIDIEventList * list);
@@ -199,10 +331,84 @@ int MIDITrack_add_channel_event(MIDITrack * track,
 
 int MIDITrack_add_meta_event(MIDITrack * track, uint32_t delta, MetaType type,
                              void * data);
+/* adds a META_TEXT to META_CUE_POINT event whose text is id in a
+ * MIDIStringPool, as the loader does. nothing is freed for it */
+int MIDITrack_add_text_event(MIDITrack * track, uint32_t delta,
+                             MetaType type, uint32_t id);
 void MIDITrack_delete_events(MIDITrack * track);
+/* bytes allocated for the track's events and their data, not counting
+ * allocator overhead or strings held in a MIDIStringPool. only data of the
+ * kinds the loader creates (channel events, tempo and SMPTE offset) is
+ * counted, the size of other data added by hand is not known */
+size_t MIDITrack_memory_usage(const MIDITrack * track);
+
+/* loads the next track in the file into packed form */
+int MIDIPackedTrack_load(MIDIPackedTrack * track, FILE * file);
+//returns the meta event an escaped packed event refers to,
+// NULL if ev is a channel event
+MIDIEvent * MIDIPackedTrack_get_meta(const MIDIPackedTrack * track,
+                                     const MIDIPackedEvent * ev);
+void MIDIPackedTrack_delete_events(MIDIPackedTrack * track);
+//same as MIDITrack_memory_usage
+size_t MIDIPackedTrack_memory_usage(const MIDIPackedTrack * track);
 
 unsigned long SMPTE_to_milliseconds(SMPTEData smpte);
 
+void MIDIChaseState_init(MIDIChaseState * state);
+void MIDIChaseState_delete(MIDIChaseState * state);
+/* applies one channel event, type is an EventType.
+ * the update and chase functions return MEMORY_ERROR if the parameter
+ * table of a channel could not grow, SUCCESS otherwise */
+int MIDIChaseState_update(MIDIChaseState * state, uint8_t type,
+                          uint8_t channel, uint8_t param1, uint8_t param2);
+//applies ev if it is a channel event, ignores anything else
+int MIDIChaseState_update_event(MIDIChaseState * state, const MIDIEvent * ev);
+//applies count packed events in order
+int MIDIChaseState_update_packed(MIDIChaseState * state,
+                                 const MIDIPackedEvent * events,
+                                 uint32_t count);
+/* apply every event of the track that comes before tick (in delta time
+ * units from the start of the track). *applied is set to the number of
+ * events applied, which is also the index of the first event to play from
+ * tick on. only for a single track, see MIDIChaseState_chase_tracks */
+int MIDIChaseState_chase_track(MIDIChaseState * state,
+                               const MIDITrack * track, uint32_t tick,
+                               uint32_t * applied);
+int MIDIChaseState_chase_packed_track(MIDIChaseState * state,
+                                      const MIDIPackedTrack * track,
+                                      uint32_t tick, uint32_t * applied);
+/* the same for all tracks of a format 0 or 1 file. events are applied in
+ * the order they play: by absolute tick, and by track for events on the
+ * same tick, so the latest value wins whichever track set it.
+ * applied (num_tracks entries) gets the count for each track, or NULL */
+int MIDIChaseState_chase_tracks(MIDIChaseState * state,
+                                const MIDITrack * tracks,
+                                uint16_t num_tracks, uint32_t tick,
+                                uint32_t * applied);
+int MIDIChaseState_chase_packed_tracks(MIDIChaseState * state,
+                                       const MIDIPackedTrack * tracks,
+                                       uint16_t num_tracks, uint32_t tick,
+                                       uint32_t * applied);
+/* appends the shortest list of channel events (all with delta time 0)
+ * that puts a device into this state to out, which must already have
+ * an event list. bank select comes before program change, MSBs before
+ * LSBs, and the parameter selected for data entry is selected last */
+int MIDIChaseState_emit(const MIDIChaseState * state, MIDITrack * out);
+
+MIDIStringPool * MIDIStringPool_create();
+/* must outlive every track holding ids from it */
+void MIDIStringPool_delete(MIDIStringPool * pool);
+/* stores len bytes of str (need not be NUL-terminated) unless an equal
+ * string is already present, and sets id to its id */
+int MIDIStringPool_intern(MIDIStringPool * pool, const char * str,
+                          uint32_t len, uint32_t * id);
+/* returns the NUL-terminated string for id, or NULL if no such id.
+ * the pointer stays valid until the pool is deleted.
+ * set len to NULL if you don't need it */
+const char * MIDIStringPool_get(MIDIStringPool * pool, uint32_t id,
+                                uint32_t * len);
+uint32_t MIDIStringPool_count(MIDIStringPool * pool);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2014 Nicholas Parkanyi
+ * See LICENSE
+*/
+#ifndef LIBMIDI_HPP
+#define LIBMIDI_HPP
+
+/* header-only C++17 layer over libmidi.h
+ * RAII owners for files, tracks and string pools, real iterators for
+ * range-for, and a templated track decoder that calls the visitor with a
+ * distinct type per event kind, so the per-event dispatch is resolved at
+ * compile time. errors are reported by throwing midi::Error. */
+
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "libmidi.h"
+
+namespace midi {
+
+class Error : public std::runtime_error {
+public:
+  explicit Error(int code)
+    : std::runtime_error(message(code)), code_(code) {}
+
+  int code() const { return code_; }
+
+  static const char * message(int code)
+  {
+    switch (code){
+      case FILE_IO_ERROR: return "libmidi: file io error";
+      case FILE_INVALID: return "libmidi: invalid MIDI data";
+      case VLV_ERROR: return "libmidi: invalid variable length value";
+      case MEMORY_ERROR: return "libmidi: out of memory";
+      default: return "libmidi: unknown error";
+    }
+  }
+
+private:
+  int code_;
+};
+
+inline void check(int r)
+{
+  if (r != SUCCESS)
+    throw Error(r);
+}
+
+
+class StringPool {
+public:
+  StringPool() : pool_(MIDIStringPool_create())
+  {
+    if (!pool_)
+      throw Error(MEMORY_ERROR);
+  }
+  ~StringPool() { MIDIStringPool_delete(pool_); }
+  StringPool(const StringPool &) = delete;
+  StringPool & operator=(const StringPool &) = delete;
+
+  uint32_t intern(const char * str, uint32_t len)
+  {
+    uint32_t id;
+    check(MIDIStringPool_intern(pool_, str, len, &id));
+    return id;
+  }
+  const char * get(uint32_t id) const
+  {
+    return MIDIStringPool_get(pool_, id, nullptr);
+  }
+  uint32_t size() const { return MIDIStringPool_count(pool_); }
+
+  MIDIStringPool * get() { return pool_; }
+
+private:
+  MIDIStringPool * pool_;
+};
+
+
+class EventIterator {
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = MIDIEvent;
+  using difference_type = std::ptrdiff_t;
+  using pointer = MIDIEvent *;
+  using reference = MIDIEvent &;
+
+  EventIterator() : node_(nullptr) {}
+  explicit EventIterator(MIDIEventNode * node) : node_(node) {}
+
+  reference operator*() const { return node_->ev; }
+  pointer operator->() const { return &node_->ev; }
+  EventIterator & operator++() { node_ = node_->next; return *this; }
+  EventIterator operator++(int)
+  {
+    EventIterator tmp = *this;
+    node_ = node_->next;
+    return tmp;
+  }
+  bool operator==(const EventIterator & o) const { return node_ == o.node_; }
+  bool operator!=(const EventIterator & o) const { return node_ != o.node_; }
+
+private:
+  MIDIEventNode * node_;
+};
+
+
+class Track {
+public:
+  Track() : track_() {}
+  //takes ownership of a loaded track
+  explicit Track(const MIDITrack & track) : track_(track) {}
+  ~Track() { MIDITrack_delete_events(&track_); }
+  Track(const Track &) = delete;
+  Track & operator=(const Track &) = delete;
+  Track(Track && o) noexcept : track_(o.track_) { o.track_.list = nullptr; }
+  Track & operator=(Track && o) noexcept
+  {
+    std::swap(track_, o.track_);
+    return *this;
+  }
+
+  EventIterator begin() const
+  {
+    return EventIterator(track_.list ? track_.list->head : nullptr);
+  }
+  EventIterator end() const { return EventIterator(); }
+
+  const MIDITrackHeader & header() const { return track_.header; }
+  size_t memory_usage() const { return MIDITrack_memory_usage(&track_); }
+
+  MIDITrack * get() { return &track_; }
+
+private:
+  MIDITrack track_;
+};
+
+
+class PackedTrack {
+public:
+  PackedTrack() : track_() {}
+  //takes ownership of a loaded track
+  explicit PackedTrack(const MIDIPackedTrack & track) : track_(track) {}
+  ~PackedTrack() { MIDIPackedTrack_delete_events(&track_); }
+  PackedTrack(const PackedTrack &) = delete;
+  PackedTrack & operator=(const PackedTrack &) = delete;
+  PackedTrack(PackedTrack && o) noexcept : track_(o.track_)
+  {
+    o.track_ = MIDIPackedTrack();
+  }
+  PackedTrack & operator=(PackedTrack && o) noexcept
+  {
+    std::swap(track_, o.track_);
+    return *this;
+  }
+
+  const MIDIPackedEvent * begin() const { return track_.events; }
+  const MIDIPackedEvent * end() const
+  {
+    return track_.events + track_.num_events;
+  }
+  size_t size() const { return track_.num_events; }
+
+  //NULL for channel events
+  MIDIEvent * meta(const MIDIPackedEvent & ev) const
+  {
+    return MIDIPackedTrack_get_meta(&track_, &ev);
+  }
+
+  const MIDITrackHeader & header() const { return track_.header; }
+  size_t memory_usage() const
+  {
+    return MIDIPackedTrack_memory_usage(&track_);
+  }
+
+  MIDIPackedTrack * get() { return &track_; }
+
+private:
+  MIDIPackedTrack track_;
+};
+
+
+class File {
+public:
+  explicit File(const char * filename)
+  {
+    check(MIDIFile_load(&midi_, filename));
+  }
+  ~File() { MIDIFile_delete(&midi_); }
+  File(const File &) = delete;
+  File & operator=(const File &) = delete;
+
+  const MIDIHeader & header() const { return midi_.header; }
+  //text events are kept in pool from the next load on
+  void set_strings(StringPool & pool) { midi_.strings = pool.get(); }
+
+  //loads the next track in the file
+  Track load_track()
+  {
+    MIDITrack raw = MIDITrack();
+    int r = MIDIFile_load_track(&midi_, &raw);
+    Track track(raw);
+
+    check(r);
+    return track;
+  }
+  PackedTrack load_packed_track()
+  {
+    MIDIPackedTrack raw = MIDIPackedTrack();
+    int r = MIDIFile_load_packed_track(&midi_, &raw);
+    PackedTrack track(raw);
+
+    check(r);
+    return track;
+  }
+
+  MIDIFile * get() { return &midi_; }
+
+private:
+  MIDIFile midi_;
+};
+
+
+/* wraps MIDIFileHandle, every const member is safe to call from several
+ * threads at once */
+class FileHandle {
+public:
+  explicit FileHandle(const char * filename)
+  {
+    check(MIDIFileHandle_open(&midi_, filename));
+  }
+  ~FileHandle() { MIDIFileHandle_close(&midi_); }
+  FileHandle(const FileHandle &) = delete;
+  FileHandle & operator=(const FileHandle &) = delete;
+
+  const MIDIHeader & header() const { return midi_.header; }
+  uint16_t num_tracks() const { return midi_.header.num_tracks; }
+  void set_strings(StringPool & pool) { midi_.strings = pool.get(); }
+
+  Track load_track(uint16_t index) const
+  {
+    MIDITrack raw = MIDITrack();
+    int r = MIDIFileHandle_load_track(&midi_, index, &raw);
+    Track track(raw);
+
+    check(r);
+    return track;
+  }
+  PackedTrack load_packed_track(uint16_t index) const
+  {
+    MIDIPackedTrack raw = MIDIPackedTrack();
+    int r = MIDIFileHandle_load_packed_track(&midi_, index, &raw);
+    PackedTrack track(raw);
+
+    check(r);
+    return track;
+  }
+
+  //raw event bytes of a track (without the chunk header), for decode()
+  std::vector<uint8_t> track_data(uint16_t index) const
+  {
+    uint8_t chunk[8]; //"MTrk" and big-endian size
+    std::vector<uint8_t> data;
+    struct stat st;
+    int64_t offset, size;
+
+    if (index >= midi_.header.num_tracks)
+      throw Error(FILE_INVALID);
+
+    offset = midi_.track_offsets[index];
+    read(chunk, sizeof(chunk), offset);
+    size = static_cast<int64_t>(static_cast<uint32_t>(chunk[4]) << 24
+                                | chunk[5] << 16 | chunk[6] << 8 | chunk[7]);
+
+    //the size comes from the file, don't allocate more than it holds
+    if (fstat(midi_.fd, &st) != 0)
+      throw Error(FILE_IO_ERROR);
+    if (size > static_cast<int64_t>(st.st_size) - offset
+               - static_cast<int64_t>(sizeof(chunk)))
+      throw Error(FILE_INVALID);
+
+    data.resize(static_cast<size_t>(size));
+    read(data.data(), data.size(), offset + sizeof(chunk));
+    return data;
+  }
+
+  const MIDIFileHandle * get() const { return &midi_; }
+
+private:
+  void read(void * buf, size_t n, int64_t offset) const
+  {
+    uint8_t * dst = static_cast<uint8_t *>(buf);
+    ssize_t r;
+
+    while (n > 0){
+      r = pread(midi_.fd, dst, n, static_cast<off_t>(offset));
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        throw Error(FILE_IO_ERROR);
+      dst += r;
+      n -= static_cast<size_t>(r);
+      offset += r;
+    }
+  }
+
+  MIDIFileHandle midi_;
+};
+
+
+/* events handed to decode() visitors
+ * a visitor is any callable with an overload for each event it cares
+ * about, plus a catch-all, e.g.
+ *   struct V {
+ *     void operator()(const ChannelEvent<EV_NOTE_ON> & ev) { ... }
+ *     template <class E> void operator()(const E &) {}
+ *   }; */
+template <EventType Type>
+struct ChannelEvent {
+  static constexpr EventType type = Type;
+  uint32_t delta_time;
+  uint8_t channel;
+  uint8_t param1;
+  uint8_t param2; //0 for program change and channel aftertouch
+};
+
+struct MetaEvent {
+  uint32_t delta_time;
+  uint8_t type;
+  const uint8_t * data;
+  uint32_t size;
+};
+
+struct SysexEvent {
+  uint32_t delta_time;
+  uint8_t status; //0xF0 or 0xF7
+  const uint8_t * data;
+  uint32_t size;
+};
+
+namespace detail {
+
+//number of data bytes after each status byte, 0xFF where not a channel event
+constexpr std::array<uint8_t, 256> make_param_table()
+{
+  std::array<uint8_t, 256> table{};
+
+  for (int i = 0; i < 256; i++){
+    switch (i >> 4){
+      case EV_PROGRAM_CHANGE:
+      case EV_CHANNEL_AFTERTOUCH:
+        table[i] = 1;
+        break;
+      case EV_NOTE_OFF:
+      case EV_NOTE_ON:
+      case EV_NOTE_AFTERTOUCH:
+      case EV_CONTROLLER:
+      case EV_PITCH_BEND:
+        table[i] = 2;
+        break;
+      default:
+        table[i] = 0xFF;
+    }
+  }
+  return table;
+}
+
+constexpr std::array<uint8_t, 256> param_table = make_param_table();
+
+inline bool read_vlv(const uint8_t *& p, const uint8_t * end, uint32_t & val)
+{
+  val = 0;
+  for (int i = 0; i < 4 && p < end; i++){
+    uint8_t byte = *p++;
+    val = (val << 7) | (byte & 0x7F);
+    if ((byte & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+template <EventType Type, class Visitor>
+inline void emit(Visitor & v, uint32_t delta, uint8_t status,
+                 uint8_t p1, uint8_t p2)
+{
+  v(ChannelEvent<Type>{ delta, static_cast<uint8_t>(status & 0x0F), p1, p2 });
+}
+
+} // namespace detail
+
+/* decodes the raw event bytes of one track (see FileHandle::track_data),
+ * stopping after the end of track event or the end of the data */
+template <class Visitor>
+void decode(const uint8_t * data, size_t size, Visitor && v)
+{
+  const uint8_t * p = data;
+  const uint8_t * const end = data + size;
+  uint8_t running = 0;
+  uint32_t delta, len;
+  uint8_t status, p1, p2, n;
+
+  while (p < end){
+    if (!detail::read_vlv(p, end, delta) || p >= end)
+      throw Error(FILE_INVALID);
+
+    status = *p;
+    if (status & 0x80){
+      p++;
+    } else {
+      //running status, this byte is already param1
+      if (!running)
+        throw Error(FILE_INVALID);
+      status = running;
+    }
+
+    n = detail::param_table[status];
+    if (n != 0xFF){
+      running = status;
+      if (end - p < n)
+        throw Error(FILE_INVALID);
+      p1 = p[0];
+      p2 = n == 2 ? p[1] : 0;
+      p += n;
+
+      switch (status >> 4){
+        case EV_NOTE_OFF:
+          detail::emit<EV_NOTE_OFF>(v, delta, status, p1, p2); break;
+        case EV_NOTE_ON:
+          detail::emit<EV_NOTE_ON>(v, delta, status, p1, p2); break;
+        case EV_NOTE_AFTERTOUCH:
+          detail::emit<EV_NOTE_AFTERTOUCH>(v, delta, status, p1, p2); break;
+        case EV_CONTROLLER:
+          detail::emit<EV_CONTROLLER>(v, delta, status, p1, p2); break;
+        case EV_PROGRAM_CHANGE:
+          detail::emit<EV_PROGRAM_CHANGE>(v, delta, status, p1, p2); break;
+        case EV_CHANNEL_AFTERTOUCH:
+          detail::emit<EV_CHANNEL_AFTERTOUCH>(v, delta, status, p1, p2); break;
+        default:
+          detail::emit<EV_PITCH_BEND>(v, delta, status, p1, p2); break;
+      }
+    } else if (status == 0xFF){
+      uint8_t type;
+
+      if (p >= end)
+        throw Error(FILE_INVALID);
+      type = *p++;
+      if (!detail::read_vlv(p, end, len) || static_cast<size_t>(end - p) < len)
+        throw Error(FILE_INVALID);
+      v(MetaEvent{ delta, type, p, len });
+      p += len;
+      if (type == META_END_TRACK)
+        return;
+    } else if (status == 0xF0 || status == 0xF7){
+      if (!detail::read_vlv(p, end, len) || static_cast<size_t>(end - p) < len)
+        throw Error(FILE_INVALID);
+      v(SysexEvent{ delta, status, p, len });
+      p += len;
+    } else {
+      throw Error(FILE_INVALID);
+    }
+  }
+}
+
+template <class Visitor>
+void decode(const std::vector<uint8_t> & data, Visitor && v)
+{
+  decode(data.data(), data.size(), std::forward<Visitor>(v));
+}
+
+} // namespace midi
+
+#endif
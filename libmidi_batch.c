@@ -0,0 +1,618 @@
+/*
+ * Copyright (c) 2014 Nicholas Parkanyi
+ * See LICENSE
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "libmidi_batch.h"
+
+//build with -DLIBMIDI_NO_IO_URING to always use the thread pool
+#if defined(__linux__) && !defined(LIBMIDI_NO_IO_URING)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+
+#define DEFAULT_QUEUE_DEPTH 64
+#define MAX_QUEUE_DEPTH 4096
+#define DEFAULT_NUM_THREADS 4
+
+//a read buffer that is kept and reused for the next file
+typedef struct {
+  uint8_t * data;
+  size_t capacity;
+} MIDIBatchBuffer;
+
+static bool MIDIBatchBuffer_reserve(MIDIBatchBuffer * buf, size_t size)
+{
+  uint8_t * data;
+
+  if (size <= buf->capacity)
+    return true;
+
+  data = (uint8_t*)realloc(buf->data, size);
+  if (!data)
+    return false;
+  buf->data = data;
+  buf->capacity = size;
+  return true;
+}
+
+//opens filename for reading, returns -1 on failure
+static int open_with_size(const char * filename, size_t * size)
+{
+  struct stat st;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &st) != 0){
+    close(fd);
+    return -1;
+  }
+  *size = (size_t)st.st_size;
+  return fd;
+}
+
+
+/* thread pool loader, used where io_uring is not available */
+
+typedef struct {
+  const char * const * filenames;
+  size_t count;
+  size_t next;
+  pthread_mutex_t lock;
+  MIDIBatchCallback callback;
+  void * user_data;
+} MIDIBatchQueue;
+
+static int read_whole_file(const char * filename, MIDIBatchBuffer * buf,
+                           size_t * size)
+{
+  size_t done = 0;
+  ssize_t r;
+  int fd;
+
+  fd = open_with_size(filename, size);
+  if (fd < 0)
+    return FILE_IO_ERROR;
+
+  if (!MIDIBatchBuffer_reserve(buf, *size)){
+    close(fd);
+    return MEMORY_ERROR;
+  }
+
+  while (done < *size){
+    r = pread(fd, buf->data + done, *size - done, (off_t)done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0){
+      close(fd);
+      return FILE_IO_ERROR;
+    }
+    //file shrank since fstat
+    if (r == 0)
+      break;
+    done += r;
+  }
+
+  close(fd);
+  *size = done;
+  return SUCCESS;
+}
+
+static void * MIDIBatchQueue_worker(void * arg)
+{
+  MIDIBatchQueue * queue = (MIDIBatchQueue*)arg;
+  MIDIBatchBuffer buf = { NULL, 0 };
+  size_t i, size;
+  int r;
+
+  for (;;){
+    pthread_mutex_lock(&queue->lock);
+    i = queue->next;
+    if (i < queue->count)
+      queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if (i >= queue->count)
+      break;
+
+    size = 0;
+    r = read_whole_file(queue->filenames[i], &buf, &size);
+    queue->callback(queue->filenames[i], r,
+                    r == SUCCESS ? buf.data : NULL, r == SUCCESS ? size : 0,
+                    queue->user_data);
+  }
+
+  free(buf.data);
+  return NULL;
+}
+
+static int MIDIBatch_load_threads(const char * const * filenames,
+                                  size_t count, unsigned num_threads,
+                                  MIDIBatchCallback callback,
+                                  void * user_data)
+{
+  MIDIBatchQueue queue;
+  pthread_t * threads;
+  unsigned i, started = 0;
+
+  queue.filenames = filenames;
+  queue.count = count;
+  queue.next = 0;
+  queue.callback = callback;
+  queue.user_data = user_data;
+  if (pthread_mutex_init(&queue.lock, NULL) != 0)
+    return MEMORY_ERROR;
+
+  if (num_threads > count)
+    num_threads = (unsigned)count;
+
+  threads = (pthread_t*)malloc(sizeof(pthread_t) * (num_threads + 1));
+  if (threads){
+    for (i = 0; i < num_threads; i++){
+      if (pthread_create(&threads[started], NULL, MIDIBatchQueue_worker,
+                         &queue) == 0)
+        started++;
+    }
+  }
+
+  //if no thread could be started, do the work here
+  if (started == 0)
+    MIDIBatchQueue_worker(&queue);
+
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  pthread_mutex_destroy(&queue.lock);
+  return SUCCESS;
+}
+
+
+#ifdef HAVE_IO_URING
+
+/* io_uring loader, talks to the kernel directly so there is no liburing
+ * dependency */
+
+typedef struct {
+  int fd;
+  unsigned entries;
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned * sq_mask;
+  unsigned * sq_array;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned * cq_mask;
+  struct io_uring_sqe * sqes;
+  struct io_uring_cqe * cqes;
+  void * sq_ring;
+  size_t sq_ring_size;
+  void * cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  //queued but not yet passed to io_uring_enter
+  unsigned to_submit;
+} MIDIRing;
+
+//user_data of cancel requests, reads use the slot index
+#define CANCEL_USER_DATA UINT64_MAX
+
+//one file being read, free when fd is -1
+typedef struct {
+  const char * filename;
+  int fd;
+  size_t size;
+  size_t done;
+  //a read is queued or in the kernel, iov and buf must stay valid
+  bool pending;
+  struct iovec iov;
+  MIDIBatchBuffer buf;
+} MIDIBatchSlot;
+
+static void MIDIRing_destroy(MIDIRing * ring)
+{
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+static bool MIDIRing_init(MIDIRing * ring, unsigned entries)
+{
+  struct io_uring_params p;
+  uint8_t * sq, * cq;
+
+  memset(ring, 0, sizeof(MIDIRing));
+  memset(&p, 0, sizeof(p));
+
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0)
+    return false;
+
+  ring->entries = p.sq_entries;
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = p.cq_off.cqes
+                       + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP){
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED){
+    ring->sq_ring = NULL;
+    MIDIRing_destroy(ring);
+    return false;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP){
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED){
+      ring->cq_ring = NULL;
+      MIDIRing_destroy(ring);
+      return false;
+    }
+  }
+
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE,
+                                          ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED){
+    ring->sqes = NULL;
+    MIDIRing_destroy(ring);
+    return false;
+  }
+
+  sq = (uint8_t*)ring->sq_ring;
+  cq = (uint8_t*)ring->cq_ring;
+  ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+  ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return true;
+}
+
+/* queues a read of the rest of the slot's file
+ * every slot has at most one read and one cancel in flight and there are
+ * no more than half as many slots as ring entries, so the submission
+ * queue never overflows */
+static void MIDIRing_queue_read(MIDIRing * ring, MIDIBatchSlot * slot,
+                                unsigned index)
+{
+  unsigned tail = *ring->sq_tail;
+  unsigned i = tail & *ring->sq_mask;
+  struct io_uring_sqe * sqe = &ring->sqes[i];
+
+  slot->iov.iov_base = slot->buf.data + slot->done;
+  slot->iov.iov_len = slot->size - slot->done;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = slot->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&slot->iov;
+  sqe->len = 1;
+  sqe->off = slot->done;
+  sqe->user_data = index;
+
+  ring->sq_array[i] = i;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+  slot->pending = true;
+}
+
+//queues a cancel of the read with the given slot index
+static void MIDIRing_queue_cancel(MIDIRing * ring, unsigned index)
+{
+  unsigned tail = *ring->sq_tail;
+  unsigned i = tail & *ring->sq_mask;
+  struct io_uring_sqe * sqe = &ring->sqes[i];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = index;
+  sqe->user_data = CANCEL_USER_DATA;
+
+  ring->sq_array[i] = i;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
+
+//passes queued reads to the kernel without waiting for any
+static void MIDIRing_submit(MIDIRing * ring)
+{
+  int r;
+
+  do {
+    r = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 0, 0,
+                     NULL, 0);
+  } while (r < 0 && errno == EINTR);
+  //on failure they stay queued for the next MIDIRing_submit_and_wait
+  if (r > 0)
+    ring->to_submit -= (unsigned)r;
+}
+
+//submits queued reads and waits for at least one completion
+static bool MIDIRing_submit_and_wait(MIDIRing * ring)
+{
+  int r;
+
+  for (;;){
+    r = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+    if (r >= 0){
+      ring->to_submit -= (unsigned)r;
+      return true;
+    }
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      return false;
+  }
+}
+
+/* cancels every pending read and waits until the kernel has posted a
+ * completion for each one, after which the slot buffers can be freed.
+ * returns false if io_uring_enter keeps failing, the reads may then
+ * still be writing into the buffers */
+static bool MIDIRing_cancel_all(MIDIRing * ring, MIDIBatchSlot * slots,
+                                unsigned depth)
+{
+  struct io_uring_cqe * cqe;
+  unsigned i, head, tail, pending = 0;
+
+  for (i = 0; i < depth; i++){
+    if (slots[i].pending){
+      MIDIRing_queue_cancel(ring, i);
+      pending++;
+    }
+  }
+
+  while (pending > 0){
+    if (!MIDIRing_submit_and_wait(ring))
+      return false;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail){
+      cqe = &ring->cqes[head & *ring->cq_mask];
+      head++;
+      if (cqe->user_data == CANCEL_USER_DATA)
+        continue;
+      slots[cqe->user_data].pending = false;
+      pending--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+
+static void MIDIBatchSlot_finish(MIDIBatchSlot * slot, int error,
+                                 MIDIBatchCallback callback,
+                                 void * user_data)
+{
+  close(slot->fd);
+  slot->fd = -1;
+  callback(slot->filename, error, error == SUCCESS ? slot->buf.data : NULL,
+           error == SUCCESS ? slot->size : 0, user_data);
+}
+
+/* returns false if io_uring could not be set up, nothing has been handed
+ * to callback in that case. *next is how many files were started, if
+ * io_uring fails midway the rest are left to the caller, along with the
+ * files that were in flight, which go in retry (room for depth names) */
+static bool MIDIBatch_load_uring(const char * const * filenames,
+                                 size_t count, unsigned depth,
+                                 MIDIBatchCallback callback,
+                                 void * user_data, size_t * next,
+                                 const char ** retry, unsigned * num_retry)
+{
+  MIDIRing ring;
+  MIDIBatchSlot * slots, * slot;
+  struct io_uring_cqe * cqe;
+  //slots whose file is complete, in completion order, with their result
+  unsigned * ready, num_ready;
+  int * results;
+  unsigned i, head, tail, inflight = 0;
+  bool ok = true;
+
+  *num_retry = 0;
+  //twice the entries, so each read can have a cancel queued behind it
+  if (!MIDIRing_init(&ring, depth * 2))
+    return false;
+  if (depth > ring.entries / 2)
+    depth = ring.entries / 2;
+
+  slots = (MIDIBatchSlot*)calloc(depth, sizeof(MIDIBatchSlot));
+  ready = (unsigned*)malloc(sizeof(unsigned) * depth);
+  results = (int*)malloc(sizeof(int) * depth);
+  if (!slots || !ready || !results){
+    free(slots);
+    free(ready);
+    free(results);
+    MIDIRing_destroy(&ring);
+    return false;
+  }
+  for (i = 0; i < depth; i++)
+    slots[i].fd = -1;
+
+  *next = 0;
+  while (ok && (*next < count || inflight > 0)){
+    //start a read in every free slot
+    for (i = 0; i < depth && *next < count; i++){
+      slot = &slots[i];
+      if (slot->fd >= 0)
+        continue;
+
+      slot->filename = filenames[(*next)++];
+      slot->done = 0;
+      slot->fd = open_with_size(slot->filename, &slot->size);
+      if (slot->fd < 0){
+        callback(slot->filename, FILE_IO_ERROR, NULL, 0, user_data);
+        i--;
+        continue;
+      }
+      if (!MIDIBatchBuffer_reserve(&slot->buf, slot->size)){
+        close(slot->fd);
+        slot->fd = -1;
+        callback(slot->filename, MEMORY_ERROR, NULL, 0, user_data);
+        i--;
+        continue;
+      }
+      if (slot->size == 0){
+        MIDIBatchSlot_finish(slot, SUCCESS, callback, user_data);
+        i--;
+        continue;
+      }
+      MIDIRing_queue_read(&ring, slot, i);
+      inflight++;
+    }
+
+    if (inflight == 0)
+      continue;
+
+    if (!MIDIRing_submit_and_wait(&ring)){
+      ok = false;
+      break;
+    }
+
+    //collect finished files, queue the rest of short reads
+    num_ready = 0;
+    head = *ring.cq_head;
+    tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail){
+      cqe = &ring.cqes[head & *ring.cq_mask];
+      slot = &slots[cqe->user_data];
+      slot->pending = false;
+      head++;
+
+      if (cqe->res == -EINTR || cqe->res == -EAGAIN){
+        MIDIRing_queue_read(&ring, slot, (unsigned)cqe->user_data);
+        continue;
+      }
+
+      if (cqe->res < 0){
+        inflight--;
+        results[num_ready] = FILE_IO_ERROR;
+        ready[num_ready++] = (unsigned)cqe->user_data;
+        continue;
+      }
+
+      slot->done += (size_t)cqe->res;
+      //a read of 0 means the file shrank since fstat
+      if (cqe->res == 0)
+        slot->size = slot->done;
+
+      if (slot->done < slot->size){
+        MIDIRing_queue_read(&ring, slot, (unsigned)cqe->user_data);
+      } else {
+        inflight--;
+        results[num_ready] = SUCCESS;
+        ready[num_ready++] = (unsigned)cqe->user_data;
+      }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+    /* get the requeued reads going before the callbacks run, so a slow
+     * callback doesn't leave the device idle */
+    if (ring.to_submit > 0)
+      MIDIRing_submit(&ring);
+    for (i = 0; i < num_ready; i++)
+      MIDIBatchSlot_finish(&slots[ready[i]], results[i], callback,
+                           user_data);
+  }
+  free(ready);
+  free(results);
+
+  //io_uring stopped working, files still in flight are read again by the
+  //caller. if the kernel may still be writing into the buffers, leak them
+  if (!ok)
+    ok = MIDIRing_cancel_all(&ring, slots, depth);
+  for (i = 0; i < depth; i++){
+    if (slots[i].fd >= 0){
+      close(slots[i].fd);
+      slots[i].fd = -1;
+      retry[(*num_retry)++] = slots[i].filename;
+    }
+    if (ok)
+      free(slots[i].buf.data);
+  }
+  if (ok)
+    free(slots);
+  MIDIRing_destroy(&ring);
+  return true;
+}
+
+#endif
+
+
+int MIDIBatch_load(const char * const * filenames, size_t count,
+                   const MIDIBatchOptions * options,
+                   MIDIBatchCallback callback, void * user_data)
+{
+  unsigned depth = DEFAULT_QUEUE_DEPTH;
+  unsigned num_threads = DEFAULT_NUM_THREADS;
+  size_t done = 0;
+
+  if (options){
+    if (options->queue_depth)
+      depth = options->queue_depth;
+    if (options->num_threads)
+      num_threads = options->num_threads;
+  }
+  if (depth > MAX_QUEUE_DEPTH)
+    depth = MAX_QUEUE_DEPTH;
+
+  if (count == 0)
+    return SUCCESS;
+
+#ifdef HAVE_IO_URING
+  if (!options || !options->force_threads){
+    const char ** retry;
+    unsigned num_retry = 0;
+    bool started;
+
+    retry = (const char**)malloc(sizeof(char*) * depth);
+    if (retry){
+      started = MIDIBatch_load_uring(filenames, count, depth, callback,
+                                     user_data, &done, retry, &num_retry);
+      if (started && num_retry > 0)
+        MIDIBatch_load_threads(retry, num_retry, num_threads, callback,
+                               user_data);
+      free(retry);
+      if (started && done == count)
+        return SUCCESS;
+    }
+  }
+#endif
+
+  return MIDIBatch_load_threads(filenames + done, count - done, num_threads,
+                                callback, user_data);
+}
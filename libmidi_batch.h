@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2014 Nicholas Parkanyi
+ * See LICENSE
+*/
+#ifndef LIBMIDI_BATCH_H
+#define LIBMIDI_BATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "libmidi.h"
+
+/* called once per file, in completion order, with the whole file in memory
+ * (decode it with MIDIMemFile_open). if error is not SUCCESS, data is
+ * NULL. the buffer goes back to the pool when the callback returns, so
+ * copy anything that must outlive it. */
+typedef void (*MIDIBatchCallback)(const char * filename, int error,
+                                  const uint8_t * data, size_t size,
+                                  void * user_data);
+
+typedef struct {
+  //files read at once, 0 for the default of 64
+  unsigned queue_depth;
+  //threads for the pread() loader, 0 for the default of 4
+  unsigned num_threads;
+  //use the thread pool even where io_uring is available
+  bool force_threads;
+} MIDIBatchOptions;
+
+/* reads every file in filenames and hands each one to callback.
+ * on Linux the reads are submitted through io_uring, queue_depth files at
+ * a time, and callback runs on the calling thread. that thread also keeps
+ * the queue full: reads already in flight carry on while a callback runs,
+ * but the slot of a finished file is only refilled once its callback
+ * returns, so keep callbacks short (hand heavy decoding to other threads)
+ * or reads slow down to the speed of the callback. where io_uring is not
+ * available (or with force_threads) a pool of num_threads threads reads
+ * with pread() and callback runs on those threads, so it has to be
+ * thread-safe. buffers are pooled and reused between files.
+ * returns once every file has been handed to callback, errors for single
+ * files go to the callback, the return value only reports setup failures.
+ * set options to NULL for the defaults */
+int MIDIBatch_load(const char * const * filenames, size_t count,
+                   const MIDIBatchOptions * options,
+                   MIDIBatchCallback callback, void * user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "libmidi.h"
+
+#define TEST_FILE "loadtest.mid"
+
+//two tracks, with text events naming "Piano" and "verse" on both
+static const uint8_t song[] = {
+  'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 2, 0, 96,
+
+  'M', 'T', 'r', 'k', 0, 0, 0, 53,
+  0x00, 0xFF, 0x03, 5, 'P', 'i', 'a', 'n', 'o',
+  0x00, 0xFF, 0x51, 3, 0x07, 0xA1, 0x20,
+  0x00, 0xFF, 0x01, 5, 'h', 'e', 'l', 'l', 'o',
+  0x00, 0xB0, 7, 100,
+  0x0A, 0x90, 60, 100,
+  0x00, 62, 100,
+  0x60, 0x80, 60, 0,
+  0x00, 0xFF, 0x06, 5, 'v', 'e', 'r', 's', 'e',
+  0x00, 0xFF, 0x2F, 0,
+
+  'M', 'T', 'r', 'k', 0, 0, 0, 37,
+  0x00, 0xFF, 0x03, 5, 'P', 'i', 'a', 'n', 'o',
+  0x00, 0xFF, 0x06, 5, 'v', 'e', 'r', 's', 'e',
+  0x00, 0xC1, 5,
+  0x05, 0xE1, 0x00, 0x50,
+  0x00, 0xD1, 0x40,
+  0x83, 0x00, 0x81, 60, 0,
+  0x00, 0xFF, 0x2F, 0
+};
+
+//events, channel events and tempo changes per track, text not kept
+static const uint32_t num_events[2] = { 6, 5 };
+static const uint32_t num_channel[2] = { 4, 4 };
+static const uint32_t num_tempo[2] = { 1, 0 };
+//text events per track when loaded into a string pool
+static const uint32_t num_text[2] = { 3, 2 };
+
+static void write_song(void)
+{
+  FILE * file;
+  size_t written;
+
+  file = fopen(TEST_FILE, "wb");
+  assert(file);
+  written = fwrite(song, 1, sizeof(song), file);
+  assert(written == sizeof(song));
+  fclose(file);
+}
+
+static bool same_event(const MIDIEvent * a, const MIDIEvent * b)
+{
+  if (a->type != b->type || a->delta_time != b->delta_time)
+    return false;
+
+  if (a->type >= EV_NOTE_OFF && a->type <= EV_PITCH_BEND)
+    return memcmp(a->data, b->data, sizeof(MIDIChannelEventData)) == 0;
+  if (MIDIEvent_is_text(a) || MIDIEvent_is_text(b))
+    return MIDIEvent_is_text(a) && MIDIEvent_is_text(b)
+           && MIDIEvent_get_string_id(a) == MIDIEvent_get_string_id(b);
+  if (a->type == (EventType)META_TEMPO_CHANGE)
+    return *(uint32_t*)a->data == *(uint32_t*)b->data;
+  return a->data == NULL && b->data == NULL;
+}
+
+static void assert_same_track(const MIDITrack * a, const MIDITrack * b)
+{
+  MIDIEventNode * x = a->list->head, * y = b->list->head;
+
+  for (; x && y; x = x->next, y = y->next)
+    assert(same_event(&x->ev, &y->ev));
+  assert(!x && !y);
+}
+
+//expands each packed event back to a MIDIEvent and compares
+static void assert_same_packed(const MIDITrack * a, const MIDIPackedTrack * b)
+{
+  MIDIEventNode * node = a->list->head;
+  MIDIChannelEventData data;
+  MIDIEvent ev, * meta;
+  uint32_t i;
+
+  for (i = 0; i < b->num_events; i++, node = node->next){
+    assert(node);
+    meta = MIDIPackedTrack_get_meta(b, &b->events[i]);
+    if (meta){
+      ev = *meta;
+    } else {
+      ev.type = (EventType)(b->events[i].status >> 4);
+      ev.delta_time = b->events[i].delta_time;
+      data.channel = b->events[i].status & 0x0F;
+      data.param1 = b->events[i].data[0];
+      data.param2 = b->events[i].data[1];
+      ev.data = &data;
+    }
+    assert(same_event(&node->ev, &ev));
+  }
+  assert(!node);
+}
+
+static size_t list_usage(uint16_t i, uint32_t text)
+{
+  return sizeof(MIDIEventList)
+         + sizeof(MIDIEventNode) * (num_events[i] + text)
+         + sizeof(MIDIChannelEventData) * num_channel[i]
+         + sizeof(uint32_t) * num_tempo[i];
+}
+
+static size_t packed_usage(uint16_t i, uint32_t text)
+{
+  uint32_t metas = num_events[i] - num_channel[i] + text;
+
+  return sizeof(MIDIPackedEvent) * (num_events[i] + text)
+         + sizeof(MIDIEvent) * metas
+         + sizeof(uint32_t) * num_tempo[i];
+}
+
+//loads every track through each path and compares with the FILE * loader
+static void test_paths(void)
+{
+  MIDIFile file;
+  MIDIFileHandle handle;
+  MIDIMemFile mem;
+  MIDITrack want, got;
+  MIDIPackedTrack packed;
+  MIDIHeader header;
+  FILE * f;
+  uint16_t i;
+  int r;
+
+  f = fopen(TEST_FILE, "rb");
+  assert(f);
+  r = MIDIHeader_load(&header, f);
+  assert(r == SUCCESS);
+  r = MIDIFileHandle_open(&handle, TEST_FILE);
+  assert(r == SUCCESS);
+  r = MIDIMemFile_open(&mem, song, sizeof(song));
+  assert(r == SUCCESS);
+  r = MIDIFile_load(&file, TEST_FILE);
+  assert(r == SUCCESS);
+  assert(handle.header.num_tracks == 2 && mem.header.num_tracks == 2);
+
+  for (i = 0; i < 2; i++){
+    r = MIDITrack_load(&want, f);
+    assert(r == SUCCESS);
+    assert(MIDITrack_memory_usage(&want) == list_usage(i, 0));
+
+    r = MIDIFileHandle_load_track(&handle, i, &got);
+    assert(r == SUCCESS);
+    assert_same_track(&want, &got);
+    MIDITrack_delete_events(&got);
+
+    r = MIDIMemFile_load_track(&mem, i, &got);
+    assert(r == SUCCESS);
+    assert_same_track(&want, &got);
+    MIDITrack_delete_events(&got);
+
+    r = MIDIFile_load_packed_track(&file, &packed);
+    assert(r == SUCCESS);
+    assert_same_packed(&want, &packed);
+    assert(MIDIPackedTrack_memory_usage(&packed) == packed_usage(i, 0));
+    MIDIPackedTrack_delete_events(&packed);
+
+    r = MIDIFileHandle_load_packed_track(&handle, i, &packed);
+    assert(r == SUCCESS);
+    assert_same_packed(&want, &packed);
+    MIDIPackedTrack_delete_events(&packed);
+
+    r = MIDIMemFile_load_packed_track(&mem, i, &packed);
+    assert(r == SUCCESS);
+    assert_same_packed(&want, &packed);
+    MIDIPackedTrack_delete_events(&packed);
+
+    MIDITrack_delete_events(&want);
+  }
+
+  fclose(f);
+  MIDIFile_delete(&file);
+  MIDIFileHandle_close(&handle);
+  MIDIMemFile_close(&mem);
+}
+
+//same with text kept, every path shares one pool
+static void test_strings(void)
+{
+  MIDIStringPool * pool;
+  MIDIFile file;
+  MIDIFileHandle handle;
+  MIDIMemFile mem;
+  MIDITrack want[2], got;
+  MIDIPackedTrack packed;
+  const char * str;
+  uint32_t len;
+  uint16_t i;
+  int r;
+
+  pool = MIDIStringPool_create();
+  assert(pool);
+  r = MIDIFile_load(&file, TEST_FILE);
+  assert(r == SUCCESS);
+  r = MIDIFileHandle_open(&handle, TEST_FILE);
+  assert(r == SUCCESS);
+  r = MIDIMemFile_open(&mem, song, sizeof(song));
+  assert(r == SUCCESS);
+  file.strings = handle.strings = mem.strings = pool;
+
+  for (i = 0; i < 2; i++){
+    r = MIDIFile_load_track(&file, &want[i]);
+    assert(r == SUCCESS);
+    assert(MIDITrack_memory_usage(&want[i]) == list_usage(i, num_text[i]));
+
+    r = MIDIFileHandle_load_track(&handle, i, &got);
+    assert(r == SUCCESS);
+    assert_same_track(&want[i], &got);
+    MIDITrack_delete_events(&got);
+
+    r = MIDIMemFile_load_track(&mem, i, &got);
+    assert(r == SUCCESS);
+    assert_same_track(&want[i], &got);
+    MIDITrack_delete_events(&got);
+
+    r = MIDIMemFile_load_packed_track(&mem, i, &packed);
+    assert(r == SUCCESS);
+    assert_same_packed(&want[i], &packed);
+    assert(MIDIPackedTrack_memory_usage(&packed)
+           == packed_usage(i, num_text[i]));
+    MIDIPackedTrack_delete_events(&packed);
+  }
+
+  //"Piano" and "verse" appear on both tracks and in every load
+  assert(MIDIStringPool_count(pool) == 3);
+  assert(MIDIEvent_is_text(&want[0].list->head->ev));
+  assert(same_event(&want[0].list->head->ev, &want[1].list->head->ev));
+  str = MIDIStringPool_get(pool,
+                           MIDIEvent_get_string_id(&want[1].list->head->ev),
+                           &len);
+  assert(len == 5 && memcmp(str, "Piano", 5) == 0);
+  assert(same_event(&want[0].list->tail->prev->ev,
+                    &want[1].list->head->next->ev));
+
+  for (i = 0; i < 2; i++)
+    MIDITrack_delete_events(&want[i]);
+  MIDIFile_delete(&file);
+  MIDIFileHandle_close(&handle);
+  MIDIMemFile_close(&mem);
+  MIDIStringPool_delete(pool);
+}
+
+int main(){
+  write_song();
+  test_paths();
+  test_strings();
+  remove(TEST_FILE);
+  puts("load: all tests passed");
+  return 0;
+}
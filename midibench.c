@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2014 Nicholas Parkanyi
+ * See LICENSE
+*/
+/* parse benchmark with hardware performance counters
+ *
+ * usage: midibench [-n iterations] [-l label] [-o out.json]
+ *                  [-c baseline.json] [-t threshold%] file.mid...
+ *
+ * every phase of loading the given files is wrapped in perf_event_open
+ * counters (cycles, instructions, L1D/LLC misses, branch misses) as well
+ * as wall-clock time. each value is the minimum over all iterations to
+ * filter out noise. counters the kernel refuses are reported as null and
+ * ignored when comparing, and so are runs in which a counter was
+ * multiplexed with other events and therefore only sampled.
+ *
+ * -o writes the results as a JSON baseline, -c compares against one and
+ * exits with status 2 if instructions or branch misses per event got worse
+ * by more than the threshold (default 5%) in any phase but header. the
+ * other values, wall time included, vary too much from run to run to gate
+ * on and are only printed; the header phase is mostly the cost of opening
+ * the file and is left out of the comparison. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "libmidi.h"
+
+typedef enum {
+  PHASE_HEADER,
+  PHASE_EVENTS,
+  PHASE_DELETE,
+  PHASE_PACKED,
+  NUM_PHASES
+} Phase;
+
+static const char * phase_names[NUM_PHASES] = {
+  "header", "events", "delete", "packed"
+};
+
+typedef enum {
+  CTR_CYCLES,
+  CTR_INSTRUCTIONS,
+  CTR_L1D_MISSES,
+  CTR_LLC_MISSES,
+  CTR_BRANCH_MISSES,
+  NUM_COUNTERS
+} Counter;
+
+//wall time is stored after the hardware counters
+#define NUM_METRICS (NUM_COUNTERS + 1)
+#define METRIC_WALL NUM_COUNTERS
+
+static const char * metric_names[NUM_METRICS] = {
+  "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses",
+  "wall_ns"
+};
+
+//values stable enough for -c to fail on
+static const int metric_gated[NUM_METRICS] = { 0, 1, 0, 0, 1, 0 };
+
+
+//-1 marks a value that could not be measured
+typedef struct {
+  int64_t values[NUM_PHASES][NUM_METRICS];
+  uint64_t events;
+} Results;
+
+static int counter_fds[NUM_COUNTERS];
+
+static void counters_open()
+{
+  struct perf_event_attr attr;
+  int i;
+
+  for (i = 0; i < NUM_COUNTERS; i++){
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                       | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    switch ((Counter)i){
+      case CTR_CYCLES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+      case CTR_INSTRUCTIONS:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+      case CTR_L1D_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D
+                      | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                      | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+      case CTR_LLC_MISSES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+      default:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    }
+
+    counter_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (counter_fds[i] < 0)
+      fprintf(stderr, "midibench: %s counter unavailable, skipping\n",
+              metric_names[i]);
+  }
+}
+
+static void counters_close()
+{
+  int i;
+
+  for (i = 0; i < NUM_COUNTERS; i++){
+    if (counter_fds[i] >= 0)
+      close(counter_fds[i]);
+  }
+}
+
+static int64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef struct {
+  int64_t start_ns;
+} Measurement;
+
+static void measure_start(Measurement * m)
+{
+  int i;
+
+  for (i = 0; i < NUM_COUNTERS; i++){
+    if (counter_fds[i] >= 0){
+      ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  m->start_ns = now_ns();
+}
+
+/* adds the counts since measure_start to values
+ * a counter that did not run for the whole phase (because the PMU was
+ * shared) would only give an estimate, so it is marked as unmeasured */
+static void measure_stop(Measurement * m, int64_t * values)
+{
+  //layout given by the read_format set in counters_open
+  struct {
+    uint64_t value;
+    uint64_t time_enabled;
+    uint64_t time_running;
+  } count;
+  int i;
+
+  values[METRIC_WALL] += now_ns() - m->start_ns;
+  for (i = 0; i < NUM_COUNTERS; i++){
+    if (counter_fds[i] < 0){
+      values[i] = -1;
+      continue;
+    }
+    ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter_fds[i], &count, sizeof(count)) != sizeof(count)
+        || count.time_running < count.time_enabled)
+      values[i] = -1;
+    else if (values[i] >= 0)
+      values[i] += (int64_t)count.value;
+  }
+}
+
+static uint64_t count_events(const MIDITrack * track)
+{
+  MIDIEventNode * node;
+  uint64_t n = 0;
+
+  for (node = track->list->head; node; node = node->next)
+    n++;
+  return n;
+}
+
+/* runs every phase once over one file, adding to values
+ * loads through MIDIFileHandle, which skips chunks other than "MTrk" */
+static int bench_file(const char * filename,
+                      int64_t values[NUM_PHASES][NUM_METRICS],
+                      uint64_t * events)
+{
+  MIDIFileHandle midi;
+  MIDITrack * tracks;
+  MIDIPackedTrack * packed;
+  Measurement m;
+  int i, r = SUCCESS, r2 = SUCCESS;
+
+  measure_start(&m);
+  r = MIDIFileHandle_open(&midi, filename);
+  measure_stop(&m, values[PHASE_HEADER]);
+  if (r != SUCCESS)
+    return r;
+
+  tracks = (MIDITrack*)calloc(midi.header.num_tracks + 1, sizeof(MIDITrack));
+  packed = (MIDIPackedTrack*)calloc(midi.header.num_tracks + 1,
+                                    sizeof(MIDIPackedTrack));
+  if (!tracks || !packed){
+    free(tracks);
+    free(packed);
+    MIDIFileHandle_close(&midi);
+    return MEMORY_ERROR;
+  }
+
+  measure_start(&m);
+  for (i = 0; i < midi.header.num_tracks && r == SUCCESS; i++)
+    r = MIDIFileHandle_load_track(&midi, i, &tracks[i]);
+  measure_stop(&m, values[PHASE_EVENTS]);
+
+  for (i = 0; i < midi.header.num_tracks; i++){
+    if (tracks[i].list)
+      *events += count_events(&tracks[i]);
+  }
+
+  measure_start(&m);
+  for (i = 0; i < midi.header.num_tracks; i++)
+    MIDITrack_delete_events(&tracks[i]);
+  measure_stop(&m, values[PHASE_DELETE]);
+
+  measure_start(&m);
+  for (i = 0; i < midi.header.num_tracks && r2 == SUCCESS; i++)
+    r2 = MIDIFileHandle_load_packed_track(&midi, i, &packed[i]);
+  measure_stop(&m, values[PHASE_PACKED]);
+
+  for (i = 0; i < midi.header.num_tracks; i++)
+    MIDIPackedTrack_delete_events(&packed[i]);
+
+  free(tracks);
+  free(packed);
+  MIDIFileHandle_close(&midi);
+  return r != SUCCESS ? r : r2;
+}
+
+static int run(char ** files, int num_files, int iterations, Results * res)
+{
+  int64_t values[NUM_PHASES][NUM_METRICS];
+  uint64_t events;
+  int it, f, p, k, r;
+
+  for (p = 0; p < NUM_PHASES; p++){
+    for (k = 0; k < NUM_METRICS; k++)
+      res->values[p][k] = -1;
+  }
+
+  for (it = 0; it < iterations; it++){
+    memset(values, 0, sizeof(values));
+    events = 0;
+    for (f = 0; f < num_files; f++){
+      r = bench_file(files[f], values, &events);
+      if (r != SUCCESS){
+        fprintf(stderr, "midibench: failed to load %s (error %d)\n",
+                files[f], r);
+        return r;
+      }
+    }
+    res->events = events;
+
+    //keep the best run of each value
+    for (p = 0; p < NUM_PHASES; p++){
+      for (k = 0; k < NUM_METRICS; k++){
+        if (values[p][k] >= 0
+            && (res->values[p][k] < 0 || values[p][k] < res->values[p][k]))
+          res->values[p][k] = values[p][k];
+      }
+    }
+  }
+  return SUCCESS;
+}
+
+static void write_json_string(FILE * out, const char * str)
+{
+  const unsigned char * c;
+
+  fputc('"', out);
+  for (c = (const unsigned char*)str; *c; c++){
+    if (*c == '"' || *c == '\\')
+      fprintf(out, "\\%c", *c);
+    else if (*c < 0x20)
+      fprintf(out, "\\u%04x", *c);
+    else
+      fputc(*c, out);
+  }
+  fputc('"', out);
+}
+
+static void results_write(FILE * out, const Results * res,
+                          const char * label, int iterations)
+{
+  int p, k;
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"label\": ");
+  write_json_string(out, label ? label : "");
+  fprintf(out, ",\n");
+  fprintf(out, "  \"iterations\": %d,\n", iterations);
+  fprintf(out, "  \"events\": %llu,\n", (unsigned long long)res->events);
+  fprintf(out, "  \"phases\": {\n");
+  for (p = 0; p < NUM_PHASES; p++){
+    fprintf(out, "    \"%s\": {", phase_names[p]);
+    for (k = 0; k < NUM_METRICS; k++){
+      fprintf(out, "%s\"%s\": ", k ? ", " : "", metric_names[k]);
+      if (res->values[p][k] < 0)
+        fprintf(out, "null");
+      else
+        fprintf(out, "%lld", (long long)res->values[p][k]);
+    }
+    fprintf(out, "}%s\n", p + 1 < NUM_PHASES ? "," : "");
+  }
+  fprintf(out, "  }\n}\n");
+}
+
+/* reads a file written by results_write
+ * not a general JSON parser, only keys are looked up */
+static int results_read(const char * filename, Results * res)
+{
+  FILE * file;
+  char * text, * phase, * value;
+  long size;
+  char key[64];
+  int p, k;
+
+  file = fopen(filename, "rb");
+  if (!file)
+    return FILE_IO_ERROR;
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  rewind(file);
+  text = (char*)malloc(size + 1);
+  if (!text || fread(text, 1, size, file) != (size_t)size){
+    free(text);
+    fclose(file);
+    return FILE_IO_ERROR;
+  }
+  text[size] = '\0';
+  fclose(file);
+
+  value = strstr(text, "\"events\":");
+  if (!value){
+    free(text);
+    return FILE_INVALID;
+  }
+  res->events = strtoull(value + strlen("\"events\":"), NULL, 10);
+
+  for (p = 0; p < NUM_PHASES; p++){
+    snprintf(key, sizeof(key), "\"%s\": {", phase_names[p]);
+    phase = strstr(text, key);
+    for (k = 0; k < NUM_METRICS; k++){
+      res->values[p][k] = -1;
+      if (!phase)
+        continue;
+      snprintf(key, sizeof(key), "\"%s\": ", metric_names[k]);
+      value = strstr(phase, key);
+      if (value && strncmp(value + strlen(key), "null", 4) != 0)
+        res->values[p][k] = strtoll(value + strlen(key), NULL, 10);
+    }
+  }
+  free(text);
+  return SUCCESS;
+}
+
+/* prints per-event values side by side, returns the number of regressions
+ * in gated values */
+static int results_compare(const Results * base, const Results * cur,
+                           double threshold)
+{
+  double b, c, change;
+  int p, k, regressions = 0;
+  int regressed;
+
+  if (base->events != cur->events)
+    fprintf(stderr, "midibench: baseline has %llu events, this run %llu;"
+            " comparing per event\n", (unsigned long long)base->events,
+            (unsigned long long)cur->events);
+
+  printf("%-8s %-14s %14s %14s %9s\n", "phase", "per event", "baseline",
+         "current", "change");
+  for (p = 0; p < NUM_PHASES; p++){
+    if (p == PHASE_HEADER)
+      continue;
+    for (k = 0; k < NUM_METRICS; k++){
+      if (base->values[p][k] < 0 || cur->values[p][k] < 0)
+        continue;
+      b = (double)base->values[p][k] / (base->events ? base->events : 1);
+      c = (double)cur->values[p][k] / (cur->events ? cur->events : 1);
+      change = b > 0 ? (c - b) / b * 100.0 : 0.0;
+      regressed = metric_gated[k] && change > threshold;
+      printf("%-8s %-14s %14.3f %14.3f %+8.2f%%%s\n", phase_names[p],
+             metric_names[k], b, c, change,
+             regressed ? "  REGRESSION" : metric_gated[k] ? "" : "  (info)");
+      if (regressed)
+        regressions++;
+    }
+  }
+  return regressions;
+}
+
+int main(int argc, char * argv[])
+{
+  const char * label = NULL;
+  const char * out_name = NULL;
+  const char * base_name = NULL;
+  double threshold = 5.0;
+  int iterations = 10;
+  Results res, base;
+  FILE * out;
+  int opt, r;
+
+  while ((opt = getopt(argc, argv, "n:l:o:c:t:")) != -1){
+    switch (opt){
+      case 'n': iterations = atoi(optarg); break;
+      case 'l': label = optarg; break;
+      case 'o': out_name = optarg; break;
+      case 'c': base_name = optarg; break;
+      case 't': threshold = atof(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-n iterations] [-l label] [-o out.json]"
+                " [-c baseline.json] [-t threshold%%] file.mid...\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc || iterations < 1){
+    fprintf(stderr, "midibench: no MIDI files given\n");
+    return 1;
+  }
+
+  counters_open();
+  r = run(argv + optind, argc - optind, iterations, &res);
+  counters_close();
+  if (r != SUCCESS)
+    return 1;
+
+  if (out_name){
+    out = fopen(out_name, "w");
+    if (!out){
+      fprintf(stderr, "midibench: cannot write %s\n", out_name);
+      return 1;
+    }
+    results_write(out, &res, label, iterations);
+    fclose(out);
+  } else if (!base_name){
+    results_write(stdout, &res, label, iterations);
+  }
+
+  if (base_name){
+    if (results_read(base_name, &base) != SUCCESS){
+      fprintf(stderr, "midibench: cannot read baseline %s\n", base_name);
+      return 1;
+    }
+    if (results_compare(&base, &res, threshold) > 0)
+      return 2;
+  }
+  return 0;
+}